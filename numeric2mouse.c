@@ -1,466 +1,5118 @@
 // based on https://www.kernel.org/doc/html/v4.12/input/uinput.html
-#define DEBUG 1
-#define VERBOSE 1
 
+#define _GNU_SOURCE         // sched_setaffinity(), SCHED_RESET_ON_FORK
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <string.h>
+#include <strings.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <signal.h>
 #include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sysmacros.h>
+#include <spawn.h>
+#include <math.h>
+#include <getopt.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include <linux/uinput.h>
+#include <linux/lirc.h>
 #include <yaml.h>
 #include "keymappings.h"
 
 #define die(str, args...) do { \
+        int die_errno = errno; \
+        log_stop(); \
+        errno = die_errno; \
         perror(str); \
         exit(EXIT_FAILURE); \
     } while(0)
 
 #define MAX_KEYS 10
+#define MAX_ARGS 32
+#define MAX_CHILDREN 32
+#define MAX_COMMAND 512
 #define MAX_MAPPINGS 256
+#define MAX_EPOLL_EVENTS 16
+#define READ_BATCH 64           // input events per read()
+#define MAX_TIMERS 32
+#define OUTPUT_RING_SIZE 4096
+#define OUTPUT_QUEUE_SIZE 1024      // events waiting for room in the virtual device
+
+// Latency histograms, each power of two is split into 1 << HIST_SUB_BITS buckets
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+#define MAX_MOTION_KEYS 8
+#define MAX_FRAME_EVENTS (4 * MAX_KEYS + 8)
+#define MAX_DEVICES 16
+#define MAX_DEVICE_PATTERNS 8
+
+// Raw scancodes from a /dev/lirc device are keys too, numbered from KEY_CNT on
+#define MAX_SCANCODES 64
+#define CODE_CNT (KEY_CNT + MAX_SCANCODES)
+#define GRID_CELLS 9                    // grid action: a 3x3 grid, subdivided on every press
+#define GRID_RANGE 65536                // absolute pointer units across the screen
+#define LIRC_BATCH 16                   // scancode records per read()
+#define EV_LIRC 0xff                    // replay: event standing for a scancode record
+#define PREFAULT_STACK (256 * 1024)     // realtime: stack touched up front so it never faults
+
+#define CONFIG_PATH "/etc/numeric2mouse.yaml"
+#define CONTROL_PATH "/run/numeric2mouse.sock"
+#define CONTROL_REPLY_SIZE 65536        // one datagram, the mapping table of a full config fits
+#define CONTROL_TIMEOUT_MS 1000
+#define MAX_CONTROL_COMMANDS 4          // handled per wakeup of the event loop
+#define CACHE_PATH "/var/cache/numeric2mouse/config.bin"
+#define CACHE_MAGIC 0x434d324e      // "N2MC"
+#define CACHE_VERSION 10
+#define CONFIG_WARNINGS_SIZE 2048     // parse warnings kept in the config, shown again when it comes from the cache
+#define FLIGHT_PATH "/run/numeric2mouse.flight"
+#define FLIGHT_MAGIC 0x464d324e     // "N2MF"
+#define FLIGHT_VERSION 2
+#define FLIGHT_RECORDS 65536        // power of two, 1.5 MB of events
+#define INPUT_ROOT "/dev/input"
+#define INPUT_DIR "/dev/input/by-path/"
+#define DEFAULT_DEVICE_PATTERN "platform-ir-receiver*"
+#define LIRC_PREFIX "/dev/lirc"
+#define INPUTLIRC_INIT "/etc/init.d/inputlirc"
+
+// Key sequences are compiled into a trie, edges are found through an open addressing hash
+#define MAX_SEQUENCE_KEYS 8
+#define MAX_SEQUENCE_NODES 512
+#define SEQUENCE_HASH_BITS 10
+#define SEQUENCE_HASH_SIZE (1 << SEQUENCE_HASH_BITS)   // twice MAX_SEQUENCE_NODES keeps probes short
+#define MAX_SEQUENCE_PENDING (4 * MAX_SEQUENCE_KEYS)
+#define DEFAULT_SEQUENCE_TIMEOUT_MS 1000
+
+// Layers, each with its own dispatch table. Layer 0 holds the top level mappings
+#define MAX_LAYERS 8
+#define MAX_LAYER_NAME 32
+#define BITS_PER_LONG (sizeof(unsigned long) * 8)
+
+// Motion engine defaults, pointer velocity ramps linearly while a key is held
+#define DEFAULT_MOTION_RATE_HZ 100
+#define MIN_MOTION_RATE_HZ 10
+#define MAX_MOTION_RATE_HZ 1000
+
+// Acceleration curves, velocity is looked up by held time in ACCEL_STEP_MS steps
+#define MAX_ACCEL_PROFILES 16
+#define MAX_ACCEL_STEPS 8
+#define ACCEL_LUT_SIZE 256
+#define ACCEL_STEP_MS 20
+#define DEFAULT_ACCEL_SPEED 100      // pixels per second on press
+#define DEFAULT_ACCEL_RATE 800       // pixels per second gained per second held
+#define DEFAULT_ACCEL_MAX_SPEED 3000 // pixels per second
+#define DEFAULT_ACCEL_DOUBLE_MS 500  // exponential: time for the speed to double
+#define DEFAULT_ACCEL_STEP_MS 500    // stepped: time spent on each step
+
+// key_combination repeat while held, off unless repeatRateMs is set
+#define DEFAULT_REPEAT_DELAY_MS 250
+
+// execute with onBusy: queue, runs that may wait for a running instance
+#define DEFAULT_QUEUE_SIZE 4
+
+// macro: steps of all macros together, macros playing at once and the time between two steps
+#define MAX_MACRO_STEPS 1024
+#define MAX_RUNNING_MACROS 8
+#define DEFAULT_MACRO_STEP_DELAY_MS 20
+
+// Log records are formatted on the event loop into a ring and written out by a
+// background thread, so a slow stdout or journald never stalls event forwarding
+#define LOG_SLOTS 1024          // power of two
+#define LOG_LINE 256
+
+enum { LEVEL_ERROR, LEVEL_WARN, LEVEL_INFO, LEVEL_DEBUG };
+const char* level_names[] = {"error", "warn", "info", "debug"};
+
+typedef struct {
+    int level;
+    char text[LOG_LINE];
+} log_record_t;
+
+struct {
+    log_record_t ring[LOG_SLOTS];
+    _Atomic unsigned head;          // written by the event loop only
+    _Atomic unsigned tail;          // written by the log thread only
+    _Atomic unsigned long dropped;
+    sem_t ready;
+    pthread_t thread;
+    int running;
+    _Atomic int stopping;
+} logger;
+
+int log_level = LEVEL_INFO;
+int base_log_level = LEVEL_INFO;    // SIGUSR2 toggles between this and debug
+
+// Arguments are only evaluated when the level is enabled
+#define log_error(fmt, args...) do { if (log_level >= LEVEL_ERROR) log_write(LEVEL_ERROR, fmt, ##args); } while(0)
+#define log_warn(fmt, args...) do { if (log_level >= LEVEL_WARN) log_write(LEVEL_WARN, fmt, ##args); } while(0)
+#define log_info(fmt, args...) do { if (log_level >= LEVEL_INFO) log_write(LEVEL_INFO, fmt, ##args); } while(0)
+#define log_debug(fmt, args...) do { if (log_level >= LEVEL_DEBUG) log_write(LEVEL_DEBUG, fmt, ##args); } while(0)
+
+void log_write(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void log_write(int level, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    if (!logger.running) {
+        // Before the daemon starts, and for the command line tools
+        FILE* out = level <= LEVEL_WARN ? stderr : stdout;
+        vfprintf(out, fmt, args);
+        fputc('\n', out);
+        va_end(args);
+        return;
+    }
+
+    unsigned head = atomic_load_explicit(&logger.head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&logger.tail, memory_order_acquire) == LOG_SLOTS) {
+        atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+        va_end(args);
+        return;
+    }
+    log_record_t* record = &logger.ring[head & (LOG_SLOTS - 1)];
+    record->level = level;
+    vsnprintf(record->text, sizeof(record->text), fmt, args);
+    va_end(args);
+    atomic_store_explicit(&logger.head, head + 1, memory_order_release);
+    sem_post(&logger.ready);
+}
+
+void* log_thread(void* arg)
+{
+    unsigned long reported = 0;
+    for (;;) {
+        while (sem_wait(&logger.ready) < 0 && errno == EINTR);
+
+        unsigned tail = atomic_load_explicit(&logger.tail, memory_order_relaxed);
+        while (tail != atomic_load_explicit(&logger.head, memory_order_acquire)) {
+            log_record_t* record = &logger.ring[tail & (LOG_SLOTS - 1)];
+            FILE* out = record->level <= LEVEL_WARN ? stderr : stdout;
+            fputs(record->text, out);
+            fputc('\n', out);
+            atomic_store_explicit(&logger.tail, ++tail, memory_order_release);
+        }
+
+        unsigned long dropped = atomic_load_explicit(&logger.dropped, memory_order_relaxed);
+        if (dropped != reported) {
+            fprintf(stderr, "Log buffer full, dropped %lu records\n", dropped - reported);
+            reported = dropped;
+        }
+        fflush(stdout);
+        if (atomic_load(&logger.stopping)) return NULL;
+    }
+}
+
+void log_start(void)
+{
+    if (logger.running) return;
+    sem_init(&logger.ready, 0, 0);
+
+    // Signals are for the event loop, not the log thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&logger.thread, NULL, log_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        fprintf(stderr, "Could not start log thread: %s, logging synchronously\n", strerror(err));
+        return;
+    }
+    logger.running = 1;
+}
+
+// Write out whatever is still queued, also called by die()
+void log_stop(void)
+{
+    if (!logger.running) return;
+    atomic_store(&logger.stopping, 1);
+    sem_post(&logger.ready);
+    pthread_join(logger.thread, NULL);
+    logger.running = 0;
+}
+
+int parse_log_level(const char* name)
+{
+    for (int i = 0; i < (int)(sizeof(level_names) / sizeof(level_names[0])); i++)
+        if (!strcasecmp(name, level_names[i])) return i;
+    return -1;
+}
 
 typedef enum {
     ACTION_MOVE_MOUSE,
     ACTION_KEY_COMBO,
     ACTION_EXECUTE,
-    ACTION_PASSTHROUGH
+    ACTION_SWITCH_LAYER,
+    ACTION_TOGGLE_LAYER,
+    ACTION_HOLD_LAYER,
+    ACTION_PASSTHROUGH,
+    ACTION_GRID,
+    ACTION_MACRO
 } action_type_t;
 
+typedef enum {
+    ACCEL_LINEAR,
+    ACCEL_EXPONENTIAL,
+    ACCEL_CAPPED,
+    ACCEL_STEPPED
+} accel_curve_t;
+
+typedef struct {
+    accel_curve_t curve;
+    int speed;              // pixels per second on press
+    int max_speed;          // capped and exponential: top speed in pixels per second
+    int accel;              // linear and capped: pixels per second gained per second
+    int double_ms;          // exponential: time for the speed to double
+    int step_ms;            // stepped: time spent on each of steps[]
+    int steps[MAX_ACCEL_STEPS];
+    int step_count;
+} accel_params_t;
+
+typedef struct {
+    accel_params_t params;
+    uint32_t velocity[ACCEL_LUT_SIZE];  // pixels per second in 16.16 fixed point
+} accel_profile_t;
+
+// Token bucket holding burst runs that refills one every period_ns. Kept as the
+// time the bucket is full again (GCRA), so a check is one comparison
+typedef struct {
+    uint64_t period_ns;     // 0 for no limit
+    int burst;
+    uint64_t full_at;
+} token_bucket_t;
+
+typedef enum {
+    BUSY_DROP,              // ignore the press
+    BUSY_QUEUE,             // run it when an instance exits, up to queue_size waiting
+    BUSY_COALESCE,          // like a queue of one: presses while busy collapse into one run
+} busy_policy_t;
+
+// One compiled macro step, written out as a frame of its own once its delay has passed
+typedef struct {
+    uint16_t type;          // EV_KEY or EV_REL
+    uint16_t code;          // EV_KEY: the key
+    int16_t value;          // EV_KEY: 1 press, 0 release; EV_REL: x
+    int16_t y;              // EV_REL: y
+    uint32_t delay_ms;      // after the step before
+} macro_step_t;
+
 typedef struct {
     action_type_t type;
     union {
         struct {
             int x;
             int y;
+            int profile;    // index into config_t.profiles
         } mouse;
         struct {
             int keys[MAX_KEYS];
             int count;
+            int repeat_delay_ms;    // first repeat after the press
+            int repeat_rate_ms;     // time between repeats, 0 to fire on press only
+            int repeat_timeout_ms;  // stop when the remote sends nothing for this long, 0 to wait for the release
         } combo;
         struct {
-            char command[512];
-            int rate_limit_seconds;
-            time_t last_exec_time;
+            char command[MAX_COMMAND];
+            char args[MAX_COMMAND];                 // command split into NUL terminated words
+            unsigned short arg_offsets[MAX_ARGS];   // start of each word in args
+            int arg_count;
+            int shell;                              // run through /bin/sh -c, -1 when not set
+            token_bucket_t interval;                // rateLimitInSeconds: one run per interval
+            token_bucket_t per_second;              // maxPerSecond: bursts of that many per second
+            int max_instances;                      // running at once, 0 for no limit
+            busy_policy_t busy;
+            int queue_size;
+            int running;                            // instances running now
+            int queued;                             // runs waiting for an instance to exit
         } exec;
+        struct {
+            int index;      // into config_t.layers
+        } layer;
+        struct {
+            int keys[GRID_CELLS + 1];   // the cells in reading order, then the key that finishes
+        } grid;
+        struct {
+            int first;      // into config_t.macro_steps
+            int count;
+        } macro;
     } data;
 } action_t;
 
 typedef struct {
-    int code;
+    int code;               // -1 for a sequence, which is reached through the trie
+    int layer;              // index into config_t.layers
+    unsigned short sequence[MAX_SEQUENCE_KEYS];
+    int sequence_length;
     action_t action;
 } key_mapping_t;
 
-key_mapping_t mappings[MAX_MAPPINGS];
-int mapping_count = 0;
+typedef struct {
+    short mapping;          // index into mappings[] of the sequence ending here, -1 for none
+    short children;         // longer sequences continue from here
+} sequence_node_t;
+
+typedef struct {
+    unsigned short parent;
+    unsigned short code;
+    unsigned short child;   // 0 for a free slot, the root is never a child
+} sequence_edge_t;
 
-volatile int interrupted = 0;
+// A named set of mappings compiled into its own dispatch table, switching layers swaps one pointer
+typedef struct {
+    char name[MAX_LAYER_NAME];
+    int inherit;            // keys the layer does not map fall back to the top level mappings
+    int sequence_root;      // trie node the layer's sequences start from
+    short dispatch[CODE_CNT];   // index into mappings[] by key code, -1 when the key is not mapped
+} layer_t;
 
-void handle_int(int num) {
-    printf("INTERRUPT %d", num); fflush(stdout);
-    interrupted = 1;
+// Everything loaded from the YAML file, replaced as a whole on reload
+typedef struct {
+    int motion_rate_hz;
+    int stats_interval;     // seconds between latency dumps, 0 for only on SIGUSR1
+    int reload_inputlirc;   // run INPUTLIRC_INIT reload once the virtual device exists
+    int realtime_priority;  // SCHED_FIFO priority of the event loop, 0 for a normal thread
+    uint64_t cpu_affinity;  // CPUs the event loop may run on, 0 for any
+    char lirc_device[64];   // read scancodes from this /dev/lirc device, empty for none
+    int scancode_release_ms;    // release a scancode key after this long without a repeat, 0 for the protocol's
+
+    // profiles[0] is the default from settings, the rest are per mapping overrides
+    accel_profile_t profiles[MAX_ACCEL_PROFILES];
+    int profile_count;
+
+    // Device names in INPUT_DIR to grab, fnmatch() patterns
+    char device_patterns[MAX_DEVICE_PATTERNS][NAME_MAX + 1];
+    int device_pattern_count;
+
+    key_mapping_t mappings[MAX_MAPPINGS];
+    int mapping_count;
+
+    layer_t layers[MAX_LAYERS];
+    int layer_count;
+
+    // Trie of sequence mappings, one root per layer
+    sequence_node_t sequence_nodes[MAX_SEQUENCE_NODES];
+    int sequence_node_count;
+    sequence_edge_t sequence_edges[SEQUENCE_HASH_SIZE];
+    int sequence_timeout_ms;    // wait this long for the next key of a sequence
+
+    // Key code KEY_CNT + i stands for scancodes[i]
+    uint64_t scancodes[MAX_SCANCODES];
+    int scancode_count;
+
+    // The steps of every macro action, each macro a run of them
+    macro_step_t macro_steps[MAX_MACRO_STEPS];
+    int macro_step_count;
+
+    char warnings[CONFIG_WARNINGS_SIZE];    // one per line, logged again when mapped from the cache
+
+    int mapped;     // mapped from the cache rather than allocated, see free_config()
+} config_t;
+
+static inline void bit_set(unsigned long* bits, int n)
+{
+    bits[n / BITS_PER_LONG] |= 1UL << (n % BITS_PER_LONG);
 }
 
-void load_config(const char* config_path) {
-    FILE* file = fopen(config_path, "r");
-    if (!file) {
-        fprintf(stderr, "Warning: Could not open config file %s, using defaults\n", config_path);
-        return;
-    }
+static inline int bit_test(const unsigned long* bits, int n)
+{
+    return (bits[n / BITS_PER_LONG] >> (n % BITS_PER_LONG)) & 1;
+}
 
-    yaml_parser_t parser;
-    yaml_event_t event;
+config_t* config;
+const layer_t* active_layer;     // in config->layers
+const char* config_path = CONFIG_PATH;
+const char* config_file;        // being parsed, for error messages
+const char* cache_path = CACHE_PATH;
 
-    if (!yaml_parser_initialize(&parser)) {
-        fprintf(stderr, "Failed to initialize YAML parser\n");
-        fclose(file);
-        return;
-    }
+// Devices named on the command line, kept across config reloads
+char cli_patterns[MAX_DEVICE_PATTERNS][NAME_MAX + 1];
+int cli_pattern_count = 0;
 
-    yaml_parser_set_input_file(&parser, file);
+// Anything registered with epoll, data.ptr points to one of these
+typedef struct event_source {
+    int fd;
+    void (*handle)(struct event_source* src, uint32_t events);
+} event_source_t;
 
-    char current_key[256] = "";
-    char current_field[256] = "";
-    int in_mappings = 0;
-    int in_mapping_entry = 0;
-    int in_action = 0;
-    int in_keys_sequence = 0;
-    key_mapping_t temp_mapping;
-    memset(&temp_mapping, 0, sizeof(temp_mapping));
-    temp_mapping.action.data.exec.rate_limit_seconds = 0;  // 0 = no rate limit
-
-    do {
-        if (!yaml_parser_parse(&parser, &event)) {
-            fprintf(stderr, "YAML parse error\n");
-            break;
-        }
+// A timerfd in the event loop, or only a deadline when replaying a capture
+typedef struct timer_source {
+    event_source_t src;
+    uint64_t deadline;      // next expiry in now_ns() time, 0 while disarmed
+    uint64_t interval;      // period of a repeating timer, 0 for a one shot
+    void (*expired)(struct timer_source* timer);
+} timer_source_t;
 
-        switch (event.type) {
-            case YAML_MAPPING_START_EVENT:
-                if (in_mappings && !in_mapping_entry) {
-                    in_mapping_entry = 1;
-                }
-                break;
+// Events for one logical action, written to uinput with a single write()
+typedef struct {
+    struct input_event events[MAX_FRAME_EVENTS];
+    int count;
+} frame_t;
 
-            case YAML_SCALAR_EVENT: {
-                const char* value = (const char*)event.data.scalar.value;
-                
-                if (!in_mappings && strcmp(value, "mappings") == 0) {
-                    in_mappings = 1;
-                } else if (in_mapping_entry && !in_action && strlen(current_field) == 0) {
-                    strncpy(current_field, value, sizeof(current_field) - 1);
-                    
-                    if (strcmp(current_field, "key") == 0) {
-                        // Next scalar will be the key name
-                    } else if (strcmp(current_field, "action") == 0) {
-                        in_action = 1;
-                    }
-                } else if (in_mapping_entry && strcmp(current_field, "key") == 0) {
-                    temp_mapping.code = parse_key_code(value);
-                    strcpy(current_field, "");
-                } else if (in_action && strlen(current_key) == 0) {
-                    strncpy(current_key, value, sizeof(current_key) - 1);
-                    
-                    if (strcmp(current_key, "type") == 0) {
-                        // Next value is action type
-                    } else if (strcmp(current_key, "x") == 0) {
-                        // Next value is x coordinate
-                    } else if (strcmp(current_key, "y") == 0) {
-                        // Next value is y coordinate
-                    } else if (strcmp(current_key, "keys") == 0) {
-                        in_keys_sequence = 1;
-                    } else if (strcmp(current_key, "command") == 0) {
-                        // Next value is command to execute
-                    } else if (strcmp(current_key, "rateLimitInSeconds") == 0) {
-                        // Next value is rate limit in seconds
-                    }
-                } else if (in_action && strlen(current_key) > 0) {
-                    if (strcmp(current_key, "type") == 0) {
-                        if (strcmp(value, "move_mouse") == 0) {
-                            temp_mapping.action.type = ACTION_MOVE_MOUSE;
-                        } else if (strcmp(value, "key_combination") == 0) {
-                            temp_mapping.action.type = ACTION_KEY_COMBO;
-                        } else if (strcmp(value, "execute") == 0) {
-                            temp_mapping.action.type = ACTION_EXECUTE;
-                        }
-                    } else if (strcmp(current_key, "x") == 0) {
-                        temp_mapping.action.data.mouse.x = atoi(value);
-                    } else if (strcmp(current_key, "y") == 0) {
-                        temp_mapping.action.data.mouse.y = atoi(value);
-                    } else if (strcmp(current_key, "command") == 0) {
-                        strncpy(temp_mapping.action.data.exec.command, value, 
-                                sizeof(temp_mapping.action.data.exec.command) - 1);
-                    } else if (strcmp(current_key, "rateLimitInSeconds") == 0) {
-                        temp_mapping.action.data.exec.rate_limit_seconds = atoi(value);
-                    } else if (in_keys_sequence) {
-                        int key_code = parse_key_code(value);
-                        if (key_code >= 0 && temp_mapping.action.data.combo.count < MAX_KEYS) {
-                            temp_mapping.action.data.combo.keys[temp_mapping.action.data.combo.count++] = key_code;
-                        }
-                    }
-                    strcpy(current_key, "");
-                }
-                break;
-            }
+typedef struct {
+    event_source_t src;     // grabbed evdev fd, -1 when the slot is free
+    clockid_t clock;        // clock of the event timestamps, CLOCK_MONOTONIC unless the kernel refused
+    char path[PATH_MAX];
+    unsigned long keys_down[KEY_CNT / BITS_PER_LONG + 1];   // keys forwarded as pressed
+    unsigned long shadowed[KEY_CNT / BITS_PER_LONG + 1];    // keys the lirc device sends as a mapped scancode
+    int dropping;           // after SYN_DROPPED, events are discarded up to the next SYN_REPORT
+    frame_t frame;          // events passed through since the device's last SYN_REPORT
+} input_device_t;
 
-            case YAML_SEQUENCE_END_EVENT:
-                if (in_keys_sequence) {
-                    in_keys_sequence = 0;
-                    strcpy(current_key, "");
-                }
-                break;
+typedef struct {
+    input_device_t* dev;    // NULL when not held on a grabbed device
+    int code;
+    int x;
+    int y;
+    const accel_profile_t* profile;
+    uint64_t pressed_at;
+} motion_key_t;
 
-            case YAML_MAPPING_END_EVENT:
-                if (in_action) {
-                    in_action = 0;
-                } else if (in_mapping_entry) {
-                    // Save the completed mapping
-                    if (temp_mapping.code >= 0 && mapping_count < MAX_MAPPINGS) {
-                        mappings[mapping_count++] = temp_mapping;
-                    }
-                    memset(&temp_mapping, 0, sizeof(temp_mapping));
-                    in_mapping_entry = 0;
-                    strcpy(current_field, "");
-                }
-                break;
+typedef struct {
+    timer_source_t timer;   // only armed while a key is held
+    motion_key_t keys[MAX_MOTION_KEYS];
+    int count;
+    uint64_t last_tick;
+    int64_t remainder_x;    // sub-pixel movement carried to the next tick, 16.16 fixed point
+    int64_t remainder_y;
+} motion_t;
 
-            default:
-                break;
-        }
+typedef struct {
+    input_device_t* dev;
+    struct input_event ev;
+} pending_key_t;
 
-        if (event.type != YAML_STREAM_END_EVENT)
-            yaml_event_delete(&event);
+// Sequence matcher, keys are held back while they may still become a sequence
+typedef struct {
+    timer_source_t timer;   // gives up on the next key after sequenceTimeoutMs
+    int node;               // trie node reached so far, only valid while count > 0
+    pending_key_t pending[MAX_SEQUENCE_PENDING];
+    int count;
+    unsigned long swallow[CODE_CNT / BITS_PER_LONG + 1];   // pressed keys that completed a sequence
+    int resolving;          // held back keys are forwarded in frames of their own, see forward_event()
+} sequence_t;
 
-    } while (event.type != YAML_STREAM_END_EVENT);
+typedef struct {
+    event_source_t src;     // inotify fd
+    int dir_wd;             // watch on INPUT_DIR, -1 until it exists
+    int root_wd;            // watch on INPUT_ROOT while waiting for INPUT_DIR
+    int config_wd;          // watch on the directory holding CONFIG_PATH
+} hotplug_t;
 
-    yaml_event_delete(&event);
-    yaml_parser_delete(&parser);
-    fclose(file);
+int epfd = -1;
+int uinput_fd = -1;
+int pointer_fd = -1;    // absolute pointer for the grid action, created when a mapping needs it
+motion_t motion;
+sequence_t sequence;
 
-    printf("Loaded %d key mappings from %s\n", mapping_count, config_path);
-}
+// A key_combination repeating while its key is held
+typedef struct {
+    timer_source_t timer;
+    int code;               // key being held, -1 when not repeating
+    input_device_t* dev;
+    const action_t* action;
+    uint64_t last_seen;     // last press or repeat from the remote
+} combo_repeat_t;
 
-void setup_device(int fdo)
-{
-   struct uinput_setup usetup;
-   if (ioctl(fdo, UI_SET_EVBIT, EV_KEY) < 0) die("error: ioctl");
-   if (ioctl(fdo, UI_SET_KEYBIT, BTN_LEFT) < 0) die("error: ioctl");
+combo_repeat_t combo_repeat = {.code = -1};
 
-   if (ioctl(fdo, UI_SET_EVBIT, EV_REL) < 0) die("error: ioctl");
-   if (ioctl(fdo, UI_SET_RELBIT, REL_X) < 0) die("error: ioctl");
-   if (ioctl(fdo, UI_SET_RELBIT, REL_Y) < 0) die("error: ioctl");
+// Where toggle_layer and hold_layer go back to
+struct {
+    int toggled_from;
+    int hold_code;          // key holding a hold_layer, -1 when none
+    int held_from;
+    input_device_t* hold_dev;   // device the hold_code key is held on
+} layer_return = {0, -1, 0, NULL};
+timer_source_t stats_timer;
+input_device_t devices[MAX_DEVICES];
+hotplug_t hotplug;
+event_source_t signals;
 
-   if (ioctl(fdo, UI_SET_EVBIT, EV_KEY) < 0) die("error: ioctl announce keys");
-   for(unsigned long i = 0; i < KEY_REFRESH_RATE_TOGGLE; i++)
-       if(ioctl(fdo, UI_SET_KEYBIT, i) < 0) die("error: ioctl announce keys");
+timer_source_t* timers[MAX_TIMERS];
+int timer_count = 0;
 
-   memset(&usetup, 0, sizeof(usetup));
-   usetup.id.bustype = BUS_USB;
-   usetup.id.vendor = 0x1234;
-   usetup.id.product = 0x5678;
-   strcpy(usetup.name, "uinput-proxy");
+// Replaying a capture runs on the capture's clock instead of CLOCK_MONOTONIC
+int replaying = 0;
+uint64_t replay_clock = 0;
 
-   if (ioctl(fdo, UI_DEV_SETUP, &usetup) < 0) die("error: ioctl");
-   if (ioctl(fdo, UI_DEV_CREATE) < 0) die("error: ioctl");
+// Where output frames go, the uinput device unless replaying
+typedef enum {
+    OUTPUT_UINPUT,
+    OUTPUT_FILE,        // text, one event per line like a capture
+    OUTPUT_MEMORY       // kept in output_ring for inspection, nothing is written
+} output_kind_t;
+
+output_kind_t output_kind = OUTPUT_UINPUT;
+FILE* output_file = NULL;
+struct input_event output_ring[OUTPUT_RING_SIZE];
+uint64_t output_count = 0;
+
+// Output a virtual device could not take yet, written when it becomes writable
+typedef struct {
+    struct input_event events[OUTPUT_QUEUE_SIZE];
+    int start, end;         // queued events are events[start..end)
+    int tail_motion;        // start of the last queued frame when it only moves the pointer, else -1
+    int stuck;              // lost events for want of room, logged again once the device takes something
+    event_source_t src;     // the device in epoll for EPOLLOUT while waiting, fd -1 otherwise
+} output_queue_t;
+
+output_queue_t output_queue = {.tail_motion = -1, .src.fd = -1};    // uinput_fd
+output_queue_t pointer_queue = {.tail_motion = -1, .src.fd = -1};   // pointer_fd
+
+struct {
+    uint64_t queued_events;     // had to wait for EPOLLOUT
+    uint64_t merged_frames;     // pointer movements added into a queued one
+    uint64_t dropped_frames;    // stale pointer movements discarded to make room
+    uint64_t dropped_events;
+    uint64_t full;              // times the queue was full with only keys queued
+    uint64_t lost_events;       // no room in the queue, or a write error
+    uint64_t errors;
+    int max_queued;
+} output_stats;
+
+FILE* record_file = NULL;       // --record, every input event as a capture line
+
+// Time from the kernel's input timestamp to our output, per kind of action
+typedef enum {
+    LATENCY_PASSTHROUGH,
+    LATENCY_MOUSE,
+    LATENCY_COMBO,
+    LATENCY_EXEC,
+    LATENCY_KINDS
+} latency_kind_t;
+
+const char* latency_names[LATENCY_KINDS] = {"passthrough", "mouse", "combo", "exec"};
+
+typedef struct {
+    uint32_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+} histogram_t;
+
+histogram_t latency[LATENCY_KINDS];
+
+// Macros playing now, see macro_play()
+typedef struct {
+    const macro_step_t* step;   // next step, NULL while the slot is free
+    const macro_step_t* end;
+    uint64_t due;               // when step goes out
+} macro_player_t;
+
+struct {
+    timer_source_t timer;       // armed for the earliest due step
+    macro_player_t players[MAX_RUNNING_MACROS];
+    histogram_t lateness;
+    uint64_t started;
+    uint64_t dropped;           // presses with every player busy
+} macros;
+
+// What reading the input devices cost and saved
+struct {
+    uint64_t reads;
+    uint64_t events;
+    uint64_t merged_events;     // REL_X/REL_Y deltas and SYN_REPORTs folded into earlier ones
+    uint64_t merged_frames;
+    uint64_t overflows;         // SYN_DROPPED from the kernel
+    uint64_t dropped_events;    // discarded after an overflow
+} input_stats;
+
+// Text answer to a control socket command, also used to format the stats for the log
+typedef struct {
+    char data[CONTROL_REPLY_SIZE];
+    size_t len;
+} reply_t;
+
+volatile int interrupted = 0;
+
+void handle_int(int num) {
+    interrupted = num;
 }
 
-int emit(int fd, int type, int code, int val)
+uint64_t clock_ns(void)
 {
-   struct input_event ie;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-   ie.type = type;
-   ie.code = code;
-   ie.value = val;
-   ie.time.tv_sec = 0;
-   ie.time.tv_usec = 0;
+// The daemon's notion of now, the capture's clock while replaying
+uint64_t now_ns(void)
+{
+    return replaying ? replay_clock : clock_ns();
+}
 
-   return write(fd, &ie, sizeof(ie)) < 0;
+static inline key_mapping_t* lookup_mapping(unsigned int code)
+{
+    if (code >= CODE_CNT || active_layer->dispatch[code] < 0) return NULL;
+    return &config->mappings[active_layer->dispatch[code]];
 }
 
-void move_mouse(int fdo, int x, int y)
+static inline unsigned int sequence_hash(unsigned int parent, unsigned int code)
 {
-    if (x) emit(fdo, EV_REL, REL_X, x);
-    if (y) emit(fdo, EV_REL, REL_Y, y);
+    return ((parent << 16 | code) * 2654435761u) >> (32 - SEQUENCE_HASH_BITS);
 }
 
-void key_combination(int fdo, int key_count, int key_codes[])
+// Node reached from parent with code, -1 when no sequence continues that way
+static inline int sequence_child(const config_t* cfg, int parent, unsigned int code)
 {
-    int i;
-    for(i=0; i<key_count; i++) {
-        if (VERBOSE) printf("combination key %d, key %x\n", i, key_codes[i]);
-        emit(fdo, EV_KEY, key_codes[i], 1);
-        emit(fdo, EV_SYN, SYN_REPORT, 0);
-    }
-    for(i=0; i<key_count-1; i++) {
-        emit(fdo, EV_KEY, key_codes[i], 0);
-        emit(fdo, EV_SYN, SYN_REPORT, 0);
+    for (unsigned int slot = sequence_hash(parent, code); cfg->sequence_edges[slot].child;
+            slot = (slot + 1) & (SEQUENCE_HASH_SIZE - 1)) {
+        const sequence_edge_t* edge = &cfg->sequence_edges[slot];
+        if (edge->parent == parent && edge->code == code) return edge->child;
     }
-    emit(fdo, EV_KEY, key_codes[i], 0);
+    return -1;
 }
 
-int can_execute(action_t* action) {
-    if (action->data.exec.rate_limit_seconds == 0) {
-				if (VERBOSE) printf("No rate limit\n");
-        return 1;
+int new_sequence_node(config_t* cfg)
+{
+    if (cfg->sequence_node_count == MAX_SEQUENCE_NODES) {
+        log_error("%s: at most %d sequence keys in total", config_file, MAX_SEQUENCE_NODES - MAX_LAYERS);
+        return -1;
     }
-
-    time_t now = time(NULL);
-    time_t time_since_last = now - action->data.exec.last_exec_time;
-    if (VERBOSE) printf("Time since last command %ld\n", time_since_last);
-    return time_since_last >= action->data.exec.rate_limit_seconds;
+    cfg->sequence_nodes[cfg->sequence_node_count].mapping = -1;
+    cfg->sequence_nodes[cfg->sequence_node_count].children = 0;
+    return cfg->sequence_node_count++;
 }
 
-void record_execution(action_t* action) {
-    action->data.exec.last_exec_time = time(NULL);
-}
+// Add the path for mappings[index] below root, the first mapping for a sequence wins
+int add_sequence(config_t* cfg, int root, int index)
+{
+    const key_mapping_t* mapping = &cfg->mappings[index];
+    int parent = root;
+    for (int i = 0; i < mapping->sequence_length; i++) {
+        int code = mapping->sequence[i];
+        int child = sequence_child(cfg, parent, code);
+        if (child < 0) {
+            if ((child = new_sequence_node(cfg)) < 0) return -1;
+            cfg->sequence_nodes[parent].children++;
 
-void execute_command(action_t* action) {
-    if (!can_execute(action)) {
-        if (VERBOSE) {
-            time_t now = time(NULL);
-            int wait_time = action->data.exec.rate_limit_seconds - (now - action->data.exec.last_exec_time);
-            printf("Rate limit: command blocked, wait %d more seconds: %s\n", 
-                   wait_time, action->data.exec.command);
+            unsigned int slot = sequence_hash(parent, code);
+            while (cfg->sequence_edges[slot].child) slot = (slot + 1) & (SEQUENCE_HASH_SIZE - 1);
+            cfg->sequence_edges[slot].parent = parent;
+            cfg->sequence_edges[slot].code = code;
+            cfg->sequence_edges[slot].child = child;
         }
-        return;
-    }
-    
-    if (VERBOSE) {
-        printf("Executing: %s\n", action->data.exec.command);
+        parent = child;
     }
-    const char *command = action->data.exec.command;
-		char *background = malloc(strlen(command) + 2); // +2 for '&' and '\0'
-		sprintf(background, "%s&", command);
-		system(background);
-		free(background);
+    if (cfg->sequence_nodes[parent].mapping < 0) cfg->sequence_nodes[parent].mapping = index;
+    return 0;
 }
 
-int handle_systemd(int argc, char* argv[])
+// Compile mappings[] into a dispatch table and sequence trie per layer, the first mapping for a key wins
+int build_dispatch(config_t* cfg)
 {
-    if (argc == 2 && (
-                !strcmp(argv[1], "stop")
-                || !strcmp(argv[1], "restart") 
-                || !strcmp(argv[1], "reload") 
-                )) {
-        char command[255] = "pkill -O1 ";
-        strcat(command, basename(argv[0]));
-        printf("command: %s\n", command); fflush(stdout);
-        system(command);
-        if (!strcmp(argv[1], "stop")) {
-                exit(0);
-        }
-    }
-    if (argc == 2 && (
-                !strcmp(argv[1], "start")
-                || !strcmp(argv[1], "restart") 
-                || !strcmp(argv[1], "reload") 
-                )) {
-        argc = 1;
-        argv[1] = "";
-    }
-    if (argc == 2 && !strcmp(argv[1], "status")) {
-        char result[2];
-        char command[1024];
-        sprintf(command, "ps -C %s -o cmd|grep -vP '^CMD$| status$'", basename(argv[0]));
-        if (VERBOSE) { printf("command: %s\n", command); fflush(stdout); }
-
-        FILE *cmd = popen(command, "r");
-        if(fgets(result, sizeof(result), cmd)) {
-            printf("Running...\n");
-        } else {
-            printf("Not running\n");
+    memset(cfg->sequence_edges, 0, sizeof(cfg->sequence_edges));
+    cfg->sequence_node_count = 0;
+
+    for (int l = 0; l < cfg->layer_count; l++) {
+        layer_t* layer = &cfg->layers[l];
+        for (int code = 0; code < CODE_CNT; code++)
+            layer->dispatch[code] = -1;
+        if ((layer->sequence_root = new_sequence_node(cfg)) < 0) return -1;
+
+        // The layer's own mappings, then the top level ones it inherits
+        for (int from = l; from >= 0; from = from && layer->inherit ? 0 : -1) {
+            for (int i = 0; i < cfg->mapping_count; i++) {
+                key_mapping_t* mapping = &cfg->mappings[i];
+                if (mapping->layer != from) continue;
+                if (mapping->sequence_length) {
+                    if (add_sequence(cfg, layer->sequence_root, i) < 0) return -1;
+                } else if (mapping->code >= 0 && mapping->code < CODE_CNT && layer->dispatch[mapping->code] < 0) {
+                    layer->dispatch[mapping->code] = i;
+                }
+            }
         }
-        pclose(cmd);
-        exit(1);
     }
-    return argc;
+    return 0;
 }
 
-char* get_input_device(char* path, char* needle)
+int find_layer(const config_t* cfg, const char* name)
 {
-    struct dirent *ep;
-    DIR *dp = opendir(path);
-    char* fullpath = malloc(255);
-    strcpy(fullpath, path);
-    if (dp != NULL) {
-        while ((ep = readdir(dp))) {
-            if (!strncmp(ep->d_name, needle, strlen(needle))) {
-                strcat(fullpath, ep->d_name);
+    for (int i = 0; i < cfg->layer_count; i++)
+        if (!strcmp(cfg->layers[i].name, name)) return i;
+    return -1;
+}
+
+void accel_defaults(accel_params_t* p)
+{
+    memset(p, 0, sizeof(*p));
+    p->curve = ACCEL_CAPPED;
+    p->speed = DEFAULT_ACCEL_SPEED;
+    p->max_speed = DEFAULT_ACCEL_MAX_SPEED;
+    p->accel = DEFAULT_ACCEL_RATE;
+    p->double_ms = DEFAULT_ACCEL_DOUBLE_MS;
+    p->step_ms = DEFAULT_ACCEL_STEP_MS;
+}
+
+// Precompute the velocity for every ACCEL_STEP_MS of held time
+void build_profile(accel_profile_t* profile)
+{
+    const accel_params_t* p = &profile->params;
+    for (int i = 0; i < ACCEL_LUT_SIZE; i++) {
+        double t = i * ACCEL_STEP_MS / 1000.0;
+        double v;
+        switch (p->curve) {
+            case ACCEL_EXPONENTIAL:
+                v = p->speed * pow(2.0, t * 1000.0 / p->double_ms);
+                break;
+            case ACCEL_STEPPED: {
+                int step = i * ACCEL_STEP_MS / p->step_ms;
+                v = p->step_count ? p->steps[step < p->step_count ? step : p->step_count - 1] : p->speed;
                 break;
             }
+            default:
+                v = p->speed + p->accel * t;
+                break;
         }
-        (void)closedir(dp);
+        if (p->curve != ACCEL_LINEAR && p->curve != ACCEL_STEPPED && v > p->max_speed) v = p->max_speed;
+        if (v > 65535) v = 65535;
+        profile->velocity[i] = (uint32_t)(v * 65536.0);
     }
-    return fullpath;
 }
 
-int main(int argc, char* argv[])
+void init_config(config_t* cfg)
 {
-    int fdo, fdi;
-    struct input_event ev;
-    char* input_device = NULL;
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->motion_rate_hz = DEFAULT_MOTION_RATE_HZ;
+    cfg->sequence_timeout_ms = DEFAULT_SEQUENCE_TIMEOUT_MS;
+    cfg->reload_inputlirc = 1;
+    strcpy(cfg->layers[0].name, "default");
+    cfg->layer_count = 1;
+    accel_defaults(&cfg->profiles[0].params);
+    build_profile(&cfg->profiles[0]);
+    cfg->profile_count = 1;
+    strcpy(cfg->device_patterns[cfg->device_pattern_count++], DEFAULT_DEVICE_PATTERN);
+    build_dispatch(cfg);
+}
 
-    struct sigaction int_handler = {.sa_handler=handle_int};
-    sigaction(SIGINT, &int_handler, 0);
-    sigaction(SIGTERM, &int_handler, 0);
+#define config_error(node, fmt, args...) do { \
+        log_error("%s:%lu: " fmt, config_file, \
+                  (unsigned long)(node)->start_mark.line + 1, ##args); \
+        return -1; \
+    } while(0)
 
-    argc = handle_systemd(argc, argv);
+// Log a warning about the config being loaded and keep it for when cfg is mapped from the cache
+void config_warn(config_t* cfg, const char* fmt, ...)
+{
+    char line[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    log_warn("%s", line);
 
-    // Load configuration
-    load_config("/etc/numeric2mouse.yaml");
+    size_t used = strlen(cfg->warnings);
+    if (used + strlen(line) + 2 <= sizeof(cfg->warnings))
+        snprintf(cfg->warnings + used, sizeof(cfg->warnings) - used, "%s\n", line);
+}
+
+const char* config_name;    // basename of CONFIG_PATH, for the inotify watch
+yaml_document_t* config_doc;
+
+yaml_node_t* yaml_node_at(int index)
+{
+    return yaml_document_get_node(config_doc, index);
+}
 
-    if (argc == 2) {
-        input_device = argv[1];
+const char* yaml_scalar(yaml_node_t* node)
+{
+    if (!node || node->type != YAML_SCALAR_NODE) return NULL;
+    return (const char*)node->data.scalar.value;
+}
+
+int parse_int(yaml_node_t* node, int* out)
+{
+    const char* value = yaml_scalar(node);
+    char* end;
+    if (!value) config_error(node, "expected a number");
+    long n = strtol(value, &end, 0);
+    if (*end || end == value) config_error(node, "expected a number, got '%s'", value);
+    *out = (int)n;
+    return 0;
+}
+
+// Seconds with an optional fraction, "0.25" for a quarter second
+int parse_seconds(yaml_node_t* node, uint64_t* ns)
+{
+    const char* value = yaml_scalar(node);
+    char* end;
+    if (!value) config_error(node, "expected a number of seconds");
+    double seconds = strtod(value, &end);
+    if (*end || end == value || seconds < 0) config_error(node, "expected a number of seconds, got '%s'", value);
+    *ns = (uint64_t)(seconds * 1e9);
+    return 0;
+}
+
+int parse_bool(yaml_node_t* node, int* out)
+{
+    const char* value = yaml_scalar(node);
+    if (value && (!strcmp(value, "true") || !strcmp(value, "yes") || !strcmp(value, "1"))) {
+        *out = 1;
+    } else if (value && (!strcmp(value, "false") || !strcmp(value, "no") || !strcmp(value, "0"))) {
+        *out = 0;
     } else {
-        input_device = get_input_device("/dev/input/by-path/", "platform-ir-receiver");
-        if (!input_device) {
-            die("error: specify input device, i.e. /dev/input/by-path/platform-ir-receiver@11-event");
+        config_error(node, "expected true or false");
+    }
+    return 0;
+}
+
+/*
+ * Split an execute command into words once at load time so a key press only
+ * needs posix_spawn(). Quotes and backslashes work like in the shell. Commands
+ * using pipes, redirection or variables need a shell, they are run through
+ * /bin/sh -c when shell: true is set, or with a warning when it is not set at all.
+ */
+int split_command(config_t* cfg, action_t* action)
+{
+    const char* in = action->data.exec.command;
+    char* out = action->data.exec.args;
+    char quote = 0;
+    int in_word = 0, needs_shell = 0;
+
+    action->data.exec.arg_count = 0;
+    for (; *in; in++) {
+        char c = *in;
+        if (quote) {
+            if (c == quote) { quote = 0; continue; }
+            if (c == '\\' && quote == '"' && in[1]) c = *++in;
+        } else if (c == ' ' || c == '\t' || c == '\n') {
+            if (in_word) { *out++ = '\0'; in_word = 0; }
+            continue;
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+            c = 0;
+        } else if (c == '\\' && in[1]) {
+            c = *++in;
+        } else if (strchr("|&;<>()$`*?[~#", c)) {
+            needs_shell = 1;
         }
+        if (!in_word) {
+            if (action->data.exec.arg_count == MAX_ARGS - 1) return -1;
+            action->data.exec.arg_offsets[action->data.exec.arg_count++] = out - action->data.exec.args;
+            in_word = 1;
+        }
+        if (c) *out++ = c;
+    }
+    *out = '\0';
+    if (quote || action->data.exec.arg_count == 0) return -1;
+
+    if (needs_shell && action->data.exec.shell < 0) {
+        config_warn(cfg, "%s: '%s' uses shell syntax, running it through /bin/sh (set shell: true to silence this)",
+                    config_file, action->data.exec.command);
+        action->data.exec.shell = 1;
     }
-    system("/etc/init.d/inputlirc reload");
+    return 0;
+}
 
-    fdo = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
-    if(fdo < 0) die("error: open uinput");
+int parse_key(yaml_node_t* node, int* code)
+{
+    const char* value = yaml_scalar(node);
+    if (!value) config_error(node, "expected a key name");
+    *code = parse_key_code(value);
+    if (*code < 0 || *code >= KEY_CNT) config_error(node, "unknown key '%s'", value);
+    return 0;
+}
 
-    printf("Opening input device %s\n", input_device);
-    fdi = open(input_device, O_RDONLY);
-    free(input_device);
-    if(fdi < 0) die("error: open input_device");
-    if(ioctl(fdi, EVIOCGRAB, 1) < 0) die("error: ioctl");
+// A raw scancode as a key code from KEY_CNT on, the same scancode always gets the same code
+int parse_scancode(config_t* cfg, yaml_node_t* node, int* code)
+{
+    const char* value = yaml_scalar(node);
+    char* end;
+    if (!value) config_error(node, "expected a scancode");
+    uint64_t scancode = strtoull(value, &end, 0);
+    if (*end || end == value) config_error(node, "expected a scancode, got '%s'", value);
+    for (int i = 0; i < cfg->scancode_count; i++) {
+        if (cfg->scancodes[i] == scancode) {
+            *code = KEY_CNT + i;
+            return 0;
+        }
+    }
+    if (cfg->scancode_count == MAX_SCANCODES) config_error(node, "at most %d different scancodes", MAX_SCANCODES);
+    cfg->scancodes[cfg->scancode_count] = scancode;
+    *code = KEY_CNT + cfg->scancode_count++;
+    return 0;
+}
 
-    setup_device(fdo);
+// A key name, or {scancode: 0x1e05}
+int parse_key_or_scancode(config_t* cfg, yaml_node_t* node, int* code)
+{
+    if (node->type != YAML_MAPPING_NODE) return parse_key(node, code);
+    yaml_node_pair_t* entry = node->data.mapping.pairs.start;
+    const char* name = entry < node->data.mapping.pairs.top ? yaml_scalar(yaml_node_at(entry->key)) : NULL;
+    if (!name || strcmp(name, "scancode") || entry + 1 != node->data.mapping.pairs.top)
+        config_error(node, "expected a key name or {scancode: ...}");
+    return parse_scancode(cfg, yaml_node_at(entry->value), code);
+}
 
-    if (!DEBUG) daemon(0,0);
+// Read acceleration fields from a settings.acceleration or move_mouse action mapping
+int parse_accel(accel_params_t* p, yaml_node_t* node)
+{
+    for (yaml_node_pair_t* pair = node->data.mapping.pairs.start; pair < node->data.mapping.pairs.top; pair++) {
+        const char* field = yaml_scalar(yaml_node_at(pair->key));
+        yaml_node_t* value = yaml_node_at(pair->value);
+        if (!field) continue;
 
-    int speed = 0;
-    while(!interrupted)
-    {
-        if(read(fdi, &ev, sizeof(struct input_event)) < 0)
-            die("error: read");
-
-        if (ev.type == EV_KEY) {
-            switch (ev.value) {
-                case 0: speed = 0; break;
-                case 1: speed = 5; break;
-                case 2: speed = speed+10; break;
-            }
-            
-            if(VERBOSE) {
-                printf("Got keycode 0x%x (%d)\n", ev.code, ev.code);
-                fflush(stdout); 
-            }
-
-            // Check mappings
-            int handled = 0;
-            for (int i = 0; i < mapping_count; i++) {
-                if (mappings[i].code == ev.code) {
-                    action_t* action = &mappings[i].action;
-                    switch (action->type) {
-                        case ACTION_MOVE_MOUSE: {
-                            int x = action->data.mouse.x;
-                            int y = action->data.mouse.y;
-                            // Apply speed multiplier
-                            if (x != 0) x = (x < 0 ? -1 : 1) * speed;
-                            if (y != 0) y = (y < 0 ? -1 : 1) * speed;
-                            move_mouse(fdo, x, y);
-                            handled = 1;
-                            break;
-                        }
-                        case ACTION_KEY_COMBO:
-                            key_combination(fdo, action->data.combo.count, action->data.combo.keys);
-                            handled = 1;
-                            break;
-                        case ACTION_EXECUTE:
-                            // Only execute on key press (value == 1), not on repeat or release
-                            if (ev.value == 1) {
-                                execute_command(action);
-                            }
-                            handled = 1;
-                            break;
-                        case ACTION_PASSTHROUGH:
-                            // Fall through to default
-                            break;
-                    }
-                    break;
-                }
+        if (strcmp(field, "acceleration") == 0) {
+            const char* curve = yaml_scalar(value);
+            if (!curve) config_error(value, "acceleration must be linear, exponential, capped or stepped");
+            if (strcmp(curve, "linear") == 0) {
+                p->curve = ACCEL_LINEAR;
+            } else if (strcmp(curve, "exponential") == 0) {
+                p->curve = ACCEL_EXPONENTIAL;
+            } else if (strcmp(curve, "capped") == 0) {
+                p->curve = ACCEL_CAPPED;
+            } else if (strcmp(curve, "stepped") == 0) {
+                p->curve = ACCEL_STEPPED;
+            } else {
+                config_error(value, "unknown acceleration '%s'", curve);
             }
-
-            if (!handled) {
-                if (write(fdo, &ev, sizeof(ev)) < 0) die("error: write");
+        } else if (strcmp(field, "speed") == 0) {
+            if (parse_int(value, &p->speed) < 0) return -1;
+        } else if (strcmp(field, "maxSpeed") == 0) {
+            if (parse_int(value, &p->max_speed) < 0) return -1;
+        } else if (strcmp(field, "accelerationRate") == 0) {
+            if (parse_int(value, &p->accel) < 0) return -1;
+        } else if (strcmp(field, "doubleEveryMs") == 0) {
+            if (parse_int(value, &p->double_ms) < 0) return -1;
+            if (p->double_ms <= 0) config_error(value, "doubleEveryMs must be positive");
+        } else if (strcmp(field, "stepMs") == 0) {
+            if (parse_int(value, &p->step_ms) < 0) return -1;
+            if (p->step_ms <= 0) config_error(value, "stepMs must be positive");
+        } else if (strcmp(field, "steps") == 0) {
+            if (value->type != YAML_SEQUENCE_NODE) config_error(value, "steps must be a list of speeds");
+            p->step_count = 0;
+            for (yaml_node_item_t* item = value->data.sequence.items.start; item < value->data.sequence.items.top; item++) {
+                if (p->step_count == MAX_ACCEL_STEPS) config_error(value, "at most %d steps", MAX_ACCEL_STEPS);
+                if (parse_int(yaml_node_at(*item), &p->steps[p->step_count++]) < 0) return -1;
             }
-        } else {
-            if (write(fdo, &ev, sizeof(ev)) < 0) die("error: write");
         }
-        usleep(15000);
     }
+    if (p->speed <= 0) config_error(node, "speed must be positive");
+    if (p->max_speed <= 0) config_error(node, "maxSpeed must be positive");
+    if (p->curve == ACCEL_STEPPED && p->step_count == 0) config_error(node, "stepped acceleration without steps");
+    return 0;
+}
+
+// Find or add the profile for p, identical settings share one lookup table
+int add_profile(config_t* cfg, const accel_params_t* p, yaml_node_t* node)
+{
+    for (int i = 0; i < cfg->profile_count; i++)
+        if (!memcmp(&cfg->profiles[i].params, p, sizeof(*p))) return i;
+    if (cfg->profile_count == MAX_ACCEL_PROFILES)
+        config_error(node, "at most %d different acceleration settings", MAX_ACCEL_PROFILES);
+    cfg->profiles[cfg->profile_count].params = *p;
+    build_profile(&cfg->profiles[cfg->profile_count]);
+    return cfg->profile_count++;
+}
+
+int parse_settings(config_t* cfg, yaml_node_t* node)
+{
+    if (node->type != YAML_MAPPING_NODE) config_error(node, "settings must be a mapping");
+
+    // The acceleration fields here are the default for every move_mouse action
+    if (parse_accel(&cfg->profiles[0].params, node) < 0) return -1;
+    build_profile(&cfg->profiles[0]);
+
+    for (yaml_node_pair_t* pair = node->data.mapping.pairs.start; pair < node->data.mapping.pairs.top; pair++) {
+        const char* field = yaml_scalar(yaml_node_at(pair->key));
+        yaml_node_t* value = yaml_node_at(pair->value);
+        if (!field) continue;
 
-    if(ioctl(fdo, UI_DEV_DESTROY) < 0) die("error: ioctl");
+        if (strcmp(field, "reloadInputlirc") == 0) {
+            if (parse_bool(value, &cfg->reload_inputlirc) < 0) return -1;
+        } else if (strcmp(field, "sequenceTimeoutMs") == 0) {
+            if (parse_int(value, &cfg->sequence_timeout_ms) < 0) return -1;
+            if (cfg->sequence_timeout_ms <= 0) config_error(value, "sequenceTimeoutMs must be positive");
+        } else if (strcmp(field, "realtimePriority") == 0) {
+            if (parse_int(value, &cfg->realtime_priority) < 0) return -1;
+            if (cfg->realtime_priority < 0 || cfg->realtime_priority > sched_get_priority_max(SCHED_FIFO))
+                config_error(value, "realtimePriority must be between 0 and %d", sched_get_priority_max(SCHED_FIFO));
+        } else if (strcmp(field, "cpuAffinity") == 0) {
+            if (value->type != YAML_SEQUENCE_NODE) config_error(value, "cpuAffinity must be a list of CPU numbers");
+            cfg->cpu_affinity = 0;
+            for (yaml_node_item_t* item = value->data.sequence.items.start; item < value->data.sequence.items.top; item++) {
+                int cpu;
+                if (parse_int(yaml_node_at(*item), &cpu) < 0) return -1;
+                if (cpu < 0 || cpu >= 64) config_error(yaml_node_at(*item), "CPU numbers must be between 0 and 63");
+                cfg->cpu_affinity |= 1ULL << cpu;
+            }
+        } else if (strcmp(field, "lircDevice") == 0) {
+            const char* path = yaml_scalar(value);
+            if (!path || strlen(path) >= sizeof(cfg->lirc_device)) config_error(value, "lircDevice must be a device path");
+            strcpy(cfg->lirc_device, path);
+        } else if (strcmp(field, "scancodeReleaseMs") == 0) {
+            if (parse_int(value, &cfg->scancode_release_ms) < 0) return -1;
+            if (cfg->scancode_release_ms < 0) config_error(value, "scancodeReleaseMs can not be negative");
+        } else if (strcmp(field, "statsIntervalSeconds") == 0) {
+            if (parse_int(value, &cfg->stats_interval) < 0) return -1;
+            if (cfg->stats_interval < 0) config_error(value, "statsIntervalSeconds can not be negative");
+        } else if (strcmp(field, "motionRateHz") == 0) {
+            if (parse_int(value, &cfg->motion_rate_hz) < 0) return -1;
+            if (cfg->motion_rate_hz < MIN_MOTION_RATE_HZ || cfg->motion_rate_hz > MAX_MOTION_RATE_HZ)
+                config_error(value, "motionRateHz must be between %d and %d", MIN_MOTION_RATE_HZ, MAX_MOTION_RATE_HZ);
+        } else if (strcmp(field, "inputDevices") == 0) {
+            if (value->type != YAML_SEQUENCE_NODE) config_error(value, "inputDevices must be a list");
+            cfg->device_pattern_count = 0;
+            for (yaml_node_item_t* item = value->data.sequence.items.start; item < value->data.sequence.items.top; item++) {
+                const char* pattern = yaml_scalar(yaml_node_at(*item));
+                if (!pattern) config_error(value, "inputDevices entries must be strings");
+                if (cfg->device_pattern_count == MAX_DEVICE_PATTERNS)
+                    config_error(value, "at most %d inputDevices", MAX_DEVICE_PATTERNS);
+                strncpy(cfg->device_patterns[cfg->device_pattern_count++], pattern, NAME_MAX);
+            }
+        }
+    }
+    return 0;
+}
+
+int macro_add(config_t* cfg, yaml_node_t* node, int type, int code, int value, int y, uint32_t delay_ms)
+{
+    if (cfg->macro_step_count == MAX_MACRO_STEPS) config_error(node, "at most %d macro steps in all", MAX_MACRO_STEPS);
+    macro_step_t* step = &cfg->macro_steps[cfg->macro_step_count++];
+    step->type = type;
+    step->code = code;
+    step->value = value;
+    step->y = y;
+    step->delay_ms = delay_ms;
+    return 0;
+}
+
+/*
+ * Compile the steps of a macro into cfg->macro_steps. Every step waits
+ * delay_ms after the one before plus any delay steps in between, a key step
+ * becomes a press and a release, and keys a press step left down are
+ * released at the end.
+ */
+int parse_macro(config_t* cfg, action_t* action, yaml_node_t* node, int delay_ms)
+{
+    unsigned long pressed[KEY_CNT / BITS_PER_LONG + 1];
+    uint32_t pause = 0;
+
+    memset(pressed, 0, sizeof(pressed));
+    if (node->type != YAML_SEQUENCE_NODE) config_error(node, "steps must be a list");
+    action->data.macro.first = cfg->macro_step_count;
+    for (yaml_node_item_t* item = node->data.sequence.items.start; item < node->data.sequence.items.top; item++) {
+        yaml_node_t* step = yaml_node_at(*item);
+        yaml_node_pair_t* pair = step->type == YAML_MAPPING_NODE ? step->data.mapping.pairs.start : NULL;
+        const char* kind = pair && pair + 1 == step->data.mapping.pairs.top ? yaml_scalar(yaml_node_at(pair->key)) : NULL;
+        if (!kind) config_error(step, "a step is one of key, press, release, move or delay");
+        yaml_node_t* value = yaml_node_at(pair->value);
+        // The first step goes out on the press
+        uint32_t delay = (cfg->macro_step_count > action->data.macro.first ? delay_ms : 0) + pause;
+
+        if (strcmp(kind, "delay") == 0) {
+            int ms;
+            if (parse_int(value, &ms) < 0) return -1;
+            if (ms < 0) config_error(value, "delay can not be negative");
+            pause += ms;
+            continue;
+        }
+        pause = 0;
+        if (strcmp(kind, "move") == 0) {
+            int x, y;
+            if (value->type != YAML_SEQUENCE_NODE || value->data.sequence.items.top - value->data.sequence.items.start != 2)
+                config_error(value, "move must be [x, y]");
+            if (parse_int(yaml_node_at(value->data.sequence.items.start[0]), &x) < 0
+                    || parse_int(yaml_node_at(value->data.sequence.items.start[1]), &y) < 0) return -1;
+            if (x < INT16_MIN || x > INT16_MAX || y < INT16_MIN || y > INT16_MAX) config_error(value, "move out of range");
+            if (macro_add(cfg, step, EV_REL, 0, x, y, delay) < 0) return -1;
+            continue;
+        }
+
+        int code;
+        if (parse_key(value, &code) < 0) return -1;
+        if (strcmp(kind, "key") == 0) {
+            if (macro_add(cfg, step, EV_KEY, code, 1, 0, delay) < 0
+                    || macro_add(cfg, step, EV_KEY, code, 0, 0, delay_ms) < 0) return -1;
+        } else if (strcmp(kind, "press") == 0) {
+            if (macro_add(cfg, step, EV_KEY, code, 1, 0, delay) < 0) return -1;
+            bit_set(pressed, code);
+        } else if (strcmp(kind, "release") == 0) {
+            if (macro_add(cfg, step, EV_KEY, code, 0, 0, delay) < 0) return -1;
+            pressed[code / BITS_PER_LONG] &= ~(1UL << (code % BITS_PER_LONG));
+        } else {
+            config_error(step, "unknown step '%s', expected key, press, release, move or delay", kind);
+        }
+    }
+    for (int code = 0; code < KEY_CNT; code++) {
+        if (bit_test(pressed, code) && macro_add(cfg, node, EV_KEY, code, 0, 0, delay_ms) < 0) return -1;
+    }
+    action->data.macro.count = cfg->macro_step_count - action->data.macro.first;
+    if (!action->data.macro.count) config_error(node, "macro without steps");
+    return 0;
+}
+
+int parse_action(config_t* cfg, action_t* action, yaml_node_t* node)
+{
+    if (node->type != YAML_MAPPING_NODE) config_error(node, "action must be a mapping");
+
+    const char* type = NULL;
+    for (yaml_node_pair_t* pair = node->data.mapping.pairs.start; pair < node->data.mapping.pairs.top; pair++) {
+        const char* field = yaml_scalar(yaml_node_at(pair->key));
+        if (field && strcmp(field, "type") == 0) type = yaml_scalar(yaml_node_at(pair->value));
+    }
+    if (!type) config_error(node, "action without a type");
+    if (strcmp(type, "move_mouse") == 0) {
+        action->type = ACTION_MOVE_MOUSE;
+    } else if (strcmp(type, "key_combination") == 0) {
+        action->type = ACTION_KEY_COMBO;
+        action->data.combo.repeat_delay_ms = DEFAULT_REPEAT_DELAY_MS;
+    } else if (strcmp(type, "execute") == 0) {
+        action->type = ACTION_EXECUTE;
+        action->data.exec.shell = -1;
+        action->data.exec.interval.burst = 1;
+        action->data.exec.queue_size = DEFAULT_QUEUE_SIZE;
+    } else if (strcmp(type, "switch_layer") == 0) {
+        action->type = ACTION_SWITCH_LAYER;
+    } else if (strcmp(type, "toggle_layer") == 0) {
+        action->type = ACTION_TOGGLE_LAYER;
+    } else if (strcmp(type, "hold_layer") == 0) {
+        action->type = ACTION_HOLD_LAYER;
+    } else if (strcmp(type, "passthrough") == 0) {
+        action->type = ACTION_PASSTHROUGH;
+    } else if (strcmp(type, "macro") == 0) {
+        action->type = ACTION_MACRO;
+    } else if (strcmp(type, "grid") == 0) {
+        action->type = ACTION_GRID;
+        for (int i = 0; i < GRID_CELLS; i++)
+            action->data.grid.keys[i] = KEY_NUMERIC_1 + i;
+        action->data.grid.keys[GRID_CELLS] = KEY_OK;
+    } else {
+        config_error(node, "unknown action type '%s'", type);
+    }
+    int layer_action = action->type == ACTION_SWITCH_LAYER || action->type == ACTION_TOGGLE_LAYER
+                    || action->type == ACTION_HOLD_LAYER;
+    if (layer_action) action->data.layer.index = -1;
+    yaml_node_t* steps = NULL;
+    int step_delay_ms = DEFAULT_MACRO_STEP_DELAY_MS;
+
+    for (yaml_node_pair_t* pair = node->data.mapping.pairs.start; pair < node->data.mapping.pairs.top; pair++) {
+        const char* field = yaml_scalar(yaml_node_at(pair->key));
+        yaml_node_t* value = yaml_node_at(pair->value);
+        if (!field) continue;
+
+        if (action->type == ACTION_MOVE_MOUSE && strcmp(field, "x") == 0) {
+            if (parse_int(value, &action->data.mouse.x) < 0) return -1;
+        } else if (action->type == ACTION_MOVE_MOUSE && strcmp(field, "y") == 0) {
+            if (parse_int(value, &action->data.mouse.y) < 0) return -1;
+        } else if (action->type == ACTION_KEY_COMBO && strcmp(field, "keys") == 0) {
+            if (value->type != YAML_SEQUENCE_NODE) config_error(value, "keys must be a list");
+            for (yaml_node_item_t* item = value->data.sequence.items.start; item < value->data.sequence.items.top; item++) {
+                int key_code;
+                if (action->data.combo.count == MAX_KEYS) config_error(value, "at most %d keys", MAX_KEYS);
+                if (parse_key(yaml_node_at(*item), &key_code) < 0) return -1;
+                action->data.combo.keys[action->data.combo.count++] = key_code;
+            }
+        } else if (action->type == ACTION_KEY_COMBO && strcmp(field, "repeatDelayMs") == 0) {
+            if (parse_int(value, &action->data.combo.repeat_delay_ms) < 0) return -1;
+            if (action->data.combo.repeat_delay_ms <= 0) config_error(value, "repeatDelayMs must be positive");
+        } else if (action->type == ACTION_KEY_COMBO && strcmp(field, "repeatRateMs") == 0) {
+            if (parse_int(value, &action->data.combo.repeat_rate_ms) < 0) return -1;
+            if (action->data.combo.repeat_rate_ms < 0) config_error(value, "repeatRateMs can not be negative");
+        } else if (action->type == ACTION_KEY_COMBO && strcmp(field, "repeatTimeoutMs") == 0) {
+            if (parse_int(value, &action->data.combo.repeat_timeout_ms) < 0) return -1;
+            if (action->data.combo.repeat_timeout_ms < 0) config_error(value, "repeatTimeoutMs can not be negative");
+        } else if (action->type == ACTION_EXECUTE && strcmp(field, "command") == 0) {
+            const char* command = yaml_scalar(value);
+            if (!command) config_error(value, "command must be a string");
+            if (strlen(command) >= sizeof(action->data.exec.command))
+                config_error(value, "command longer than %zu characters", sizeof(action->data.exec.command) - 1);
+            strcpy(action->data.exec.command, command);
+        } else if (action->type == ACTION_EXECUTE && strcmp(field, "rateLimitInSeconds") == 0) {
+            if (parse_seconds(value, &action->data.exec.interval.period_ns) < 0) return -1;
+        } else if (action->type == ACTION_EXECUTE && strcmp(field, "maxPerSecond") == 0) {
+            int rate;
+            if (parse_int(value, &rate) < 0) return -1;
+            if (rate < 0) config_error(value, "maxPerSecond must not be negative");
+            action->data.exec.per_second.burst = rate;
+            action->data.exec.per_second.period_ns = rate ? 1000000000ULL / rate : 0;
+        } else if (action->type == ACTION_EXECUTE && strcmp(field, "maxInstances") == 0) {
+            if (parse_int(value, &action->data.exec.max_instances) < 0) return -1;
+            if (action->data.exec.max_instances < 0) config_error(value, "maxInstances must not be negative");
+        } else if (action->type == ACTION_EXECUTE && strcmp(field, "queueSize") == 0) {
+            if (parse_int(value, &action->data.exec.queue_size) < 0) return -1;
+            if (action->data.exec.queue_size < 0) config_error(value, "queueSize must not be negative");
+        } else if (action->type == ACTION_EXECUTE && strcmp(field, "onBusy") == 0) {
+            const char* policy = yaml_scalar(value);
+            if (policy && !strcmp(policy, "drop")) action->data.exec.busy = BUSY_DROP;
+            else if (policy && !strcmp(policy, "queue")) action->data.exec.busy = BUSY_QUEUE;
+            else if (policy && !strcmp(policy, "coalesce")) action->data.exec.busy = BUSY_COALESCE;
+            else config_error(value, "onBusy must be drop, queue or coalesce");
+        } else if (action->type == ACTION_EXECUTE && strcmp(field, "shell") == 0) {
+            if (parse_bool(value, &action->data.exec.shell) < 0) return -1;
+        } else if (action->type == ACTION_MACRO && strcmp(field, "steps") == 0) {
+            steps = value;
+        } else if (action->type == ACTION_MACRO && strcmp(field, "stepDelayMs") == 0) {
+            if (parse_int(value, &step_delay_ms) < 0) return -1;
+            if (step_delay_ms < 0) config_error(value, "stepDelayMs can not be negative");
+        } else if (action->type == ACTION_GRID && strcmp(field, "keys") == 0) {
+            if (value->type != YAML_SEQUENCE_NODE || value->data.sequence.items.top - value->data.sequence.items.start != GRID_CELLS)
+                config_error(value, "keys must be a list of %d keys, top left first", GRID_CELLS);
+            for (int i = 0; i < GRID_CELLS; i++)
+                if (parse_key_or_scancode(cfg, yaml_node_at(value->data.sequence.items.start[i]), &action->data.grid.keys[i]) < 0) return -1;
+        } else if (action->type == ACTION_GRID && strcmp(field, "finishKey") == 0) {
+            if (parse_key_or_scancode(cfg, value, &action->data.grid.keys[GRID_CELLS]) < 0) return -1;
+        } else if (layer_action && strcmp(field, "layer") == 0) {
+            const char* name = yaml_scalar(value);
+            if (!name) config_error(value, "layer must be a layer name");
+            if ((action->data.layer.index = find_layer(cfg, name)) < 0) config_error(value, "unknown layer '%s'", name);
+        }
+    }
+
+    if (action->type == ACTION_MOVE_MOUSE) {
+        accel_params_t params = cfg->profiles[0].params;
+        if (parse_accel(&params, node) < 0) return -1;
+        action->data.mouse.profile = add_profile(cfg, &params, node);
+        if (action->data.mouse.profile < 0) return -1;
+    }
+    if (action->type == ACTION_KEY_COMBO && action->data.combo.count == 0) config_error(node, "key_combination without keys");
+    if (layer_action && action->data.layer.index < 0) config_error(node, "%s without a layer", type);
+    if (action->type == ACTION_EXECUTE && !action->data.exec.command[0]) config_error(node, "execute without a command");
+    if (action->type == ACTION_EXECUTE && split_command(cfg, action) < 0) config_error(node, "cannot split command '%s'", action->data.exec.command);
+    if (action->type == ACTION_MACRO && !steps) config_error(node, "macro without steps");
+    if (action->type == ACTION_MACRO && parse_macro(cfg, action, steps, step_delay_ms) < 0) return -1;
+    return 0;
+}
+
+int parse_mapping(config_t* cfg, key_mapping_t* mapping, yaml_node_t* node)
+{
+    yaml_node_t* action = NULL;
+    int have_key = 0;
+
+    if (node->type != YAML_MAPPING_NODE) config_error(node, "mapping entries must be mappings");
+    for (yaml_node_pair_t* pair = node->data.mapping.pairs.start; pair < node->data.mapping.pairs.top; pair++) {
+        const char* field = yaml_scalar(yaml_node_at(pair->key));
+        yaml_node_t* value = yaml_node_at(pair->value);
+        if (!field) continue;
+
+        if (strcmp(field, "key") == 0 || strcmp(field, "scancode") == 0) {
+            if (have_key) config_error(value, "mapping with both a key and a scancode");
+            if (field[0] == 'k' ? parse_key(value, &mapping->code) < 0 : parse_scancode(cfg, value, &mapping->code) < 0) return -1;
+            have_key = 1;
+        } else if (strcmp(field, "sequence") == 0) {
+            if (value->type != YAML_SEQUENCE_NODE) config_error(value, "sequence must be a list of keys");
+            for (yaml_node_item_t* item = value->data.sequence.items.start; item < value->data.sequence.items.top; item++) {
+                int key_code;
+                if (mapping->sequence_length == MAX_SEQUENCE_KEYS) config_error(value, "at most %d keys in a sequence", MAX_SEQUENCE_KEYS);
+                if (parse_key_or_scancode(cfg, yaml_node_at(*item), &key_code) < 0) return -1;
+                mapping->sequence[mapping->sequence_length++] = key_code;
+            }
+            if (mapping->sequence_length == 0) config_error(value, "empty sequence");
+        } else if (strcmp(field, "action") == 0) {
+            action = value;
+        }
+    }
+    if (have_key && mapping->sequence_length) config_error(node, "mapping with both a key and a sequence");
+    if (!have_key && !mapping->sequence_length) config_error(node, "mapping without a key or scancode");
+    if (!action) config_error(node, "mapping without an action");
+    if (parse_action(cfg, &mapping->action, action) < 0) return -1;
+    if (!mapping->sequence_length) return 0;
+
+    // A sequence fires once when its last key is pressed, there is no release to stop motion or a held layer
+    if (mapping->action.type == ACTION_MOVE_MOUSE || mapping->action.type == ACTION_HOLD_LAYER)
+        config_error(action, "move_mouse and hold_layer can not be used for a sequence");
+    if (mapping->action.type == ACTION_KEY_COMBO && mapping->action.data.combo.repeat_rate_ms)
+        config_error(action, "a sequence can not repeat");
+    mapping->code = -1;
+    return 0;
+}
+
+int parse_mappings(config_t* cfg, int layer, yaml_node_t* node)
+{
+    if (node->type != YAML_SEQUENCE_NODE) config_error(node, "mappings must be a list");
+    for (yaml_node_item_t* item = node->data.sequence.items.start; item < node->data.sequence.items.top; item++) {
+        if (cfg->mapping_count == MAX_MAPPINGS) config_error(node, "at most %d mappings", MAX_MAPPINGS);
+        cfg->mappings[cfg->mapping_count].layer = layer;
+        if (parse_mapping(cfg, &cfg->mappings[cfg->mapping_count], yaml_node_at(*item)) < 0) return -1;
+        cfg->mapping_count++;
+    }
+    return 0;
+}
+
+int parse_layer(config_t* cfg, int index, yaml_node_t* node)
+{
+    if (node->type != YAML_MAPPING_NODE) config_error(node, "layer must be a mapping");
+    for (yaml_node_pair_t* pair = node->data.mapping.pairs.start; pair < node->data.mapping.pairs.top; pair++) {
+        const char* field = yaml_scalar(yaml_node_at(pair->key));
+        yaml_node_t* value = yaml_node_at(pair->value);
+        if (!field) continue;
+
+        if (strcmp(field, "inherit") == 0) {
+            if (parse_bool(value, &cfg->layers[index].inherit) < 0) return -1;
+        } else if (strcmp(field, "mappings") == 0) {
+            if (parse_mappings(cfg, index, value) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+int parse_config(config_t* cfg, yaml_node_t* root)
+{
+    if (!root) return 0;   // empty file
+    if (root->type != YAML_MAPPING_NODE) config_error(root, "expected settings and mappings");
+
+    // Settings first, mappings inherit defaults from them wherever they are in the file
+    for (yaml_node_pair_t* pair = root->data.mapping.pairs.start; pair < root->data.mapping.pairs.top; pair++) {
+        const char* field = yaml_scalar(yaml_node_at(pair->key));
+        if (field && strcmp(field, "settings") == 0 && parse_settings(cfg, yaml_node_at(pair->value)) < 0) return -1;
+    }
+
+    // Then the layer names, actions may switch to a layer defined further down
+    for (yaml_node_pair_t* pair = root->data.mapping.pairs.start; pair < root->data.mapping.pairs.top; pair++) {
+        const char* field = yaml_scalar(yaml_node_at(pair->key));
+        yaml_node_t* value = yaml_node_at(pair->value);
+        if (!field || strcmp(field, "layers") != 0) continue;
+
+        if (value->type != YAML_MAPPING_NODE) config_error(value, "layers must be a mapping of names to layers");
+        for (yaml_node_pair_t* layer = value->data.mapping.pairs.start; layer < value->data.mapping.pairs.top; layer++) {
+            yaml_node_t* key = yaml_node_at(layer->key);
+            const char* name = yaml_scalar(key);
+            if (!name) config_error(key, "layer names must be strings");
+            if (find_layer(cfg, name) >= 0) config_error(key, "layer '%s' is defined twice", name);
+            if (strlen(name) >= MAX_LAYER_NAME) config_error(key, "layer name longer than %d characters", MAX_LAYER_NAME - 1);
+            if (cfg->layer_count == MAX_LAYERS) config_error(key, "at most %d layers", MAX_LAYERS - 1);
+            strcpy(cfg->layers[cfg->layer_count].name, name);
+            cfg->layers[cfg->layer_count++].inherit = 1;
+        }
+    }
+
+    for (yaml_node_pair_t* pair = root->data.mapping.pairs.start; pair < root->data.mapping.pairs.top; pair++) {
+        const char* field = yaml_scalar(yaml_node_at(pair->key));
+        yaml_node_t* value = yaml_node_at(pair->value);
+        if (!field) continue;
+
+        if (strcmp(field, "mappings") == 0) {
+            if (parse_mappings(cfg, 0, value) < 0) return -1;
+        } else if (strcmp(field, "layers") == 0) {
+            for (yaml_node_pair_t* layer = value->data.mapping.pairs.start; layer < value->data.mapping.pairs.top; layer++) {
+                int index = find_layer(cfg, yaml_scalar(yaml_node_at(layer->key)));
+                if (parse_layer(cfg, index, yaml_node_at(layer->value)) < 0) return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Parse config_path into cfg, on any error cfg is left incomplete and -1 returned
+int load_config(const char* config_path, config_t* cfg) {
+    init_config(cfg);
+
+    FILE* file = fopen(config_path, "re");
+    if (!file) {
+        log_error("Could not open config file %s: %s", config_path, strerror(errno));
+        return -1;
+    }
+
+    yaml_parser_t parser;
+    yaml_document_t document;
+
+    if (!yaml_parser_initialize(&parser)) {
+        log_error("Failed to initialize YAML parser");
+        fclose(file);
+        return -1;
+    }
+
+    yaml_parser_set_input_file(&parser, file);
+
+    int result = -1;
+    if (!yaml_parser_load(&parser, &document)) {
+        log_error("%s:%lu: YAML parse error: %s", config_path,
+                  (unsigned long)parser.problem_mark.line + 1, parser.problem ? parser.problem : "unknown");
+    } else {
+        config_file = config_path;
+        config_doc = &document;
+        result = parse_config(cfg, yaml_document_get_root_node(&document));
+        yaml_document_delete(&document);
+    }
+
+    yaml_parser_delete(&parser);
+    fclose(file);
+
+    if (result < 0 || build_dispatch(cfg) < 0) return -1;
+    log_info("Loaded %d key mappings from %s", cfg->mapping_count, config_path);
+    return 0;
+}
+
+/*
+ * Compiled config cache. config_t holds no pointers, so a parsed config is
+ * written out as is behind a header naming the YAML it came from, and mapped
+ * straight back in at the next start while the YAML is unchanged.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t config_size;       // sizeof(config_t), catches layout changes between builds
+    uint32_t reserved;
+    int64_t yaml_mtime_ns;
+    int64_t yaml_size;
+    uint64_t yaml_hash;         // FNV-1a over the YAML file
+} cache_header_t;
+
+// FNV-1a, a file of a few KB hashes in microseconds
+uint64_t hash_bytes(const unsigned char* data, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Fill in the yaml_* fields of header for config_path
+int stamp_config(const char* config_path, cache_header_t* header)
+{
+    struct stat st;
+    int fd = open(config_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0) { close(fd); return -1; }
+
+    memset(header, 0, sizeof(*header));
+    header->magic = CACHE_MAGIC;
+    header->version = CACHE_VERSION;
+    header->config_size = sizeof(config_t);
+    header->yaml_mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    header->yaml_size = st.st_size;
+    if (st.st_size > 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) { close(fd); return -1; }
+        header->yaml_hash = hash_bytes(data, st.st_size);
+        munmap(data, st.st_size);
+    }
+    close(fd);
+    return 0;
+}
+
+#define VALID_INDEX(i, count) ((i) >= 0 && (i) < (count))
+#define VALID_STRING(s) (memchr((s), 0, sizeof(s)) != NULL)
+
+static int valid_action(const config_t* cfg, const action_t* action)
+{
+    switch (action->type) {
+        case ACTION_MOVE_MOUSE:
+            return VALID_INDEX(action->data.mouse.profile, cfg->profile_count);
+        case ACTION_KEY_COMBO:
+            if (!VALID_INDEX(action->data.combo.count, MAX_KEYS + 1)) return 0;
+            for (int k = 0; k < action->data.combo.count; k++)
+                if (!VALID_INDEX(action->data.combo.keys[k], KEY_CNT)) return 0;
+            return 1;
+        case ACTION_EXECUTE:
+            if (!VALID_STRING(action->data.exec.command) || action->data.exec.args[MAX_COMMAND - 1]
+                    || !VALID_INDEX(action->data.exec.arg_count, MAX_ARGS)
+                    || !VALID_INDEX(action->data.exec.busy, BUSY_COALESCE + 1))
+                return 0;
+            for (int a = 0; a < action->data.exec.arg_count; a++)
+                if (action->data.exec.arg_offsets[a] >= MAX_COMMAND) return 0;
+            return 1;
+        case ACTION_SWITCH_LAYER:
+        case ACTION_TOGGLE_LAYER:
+        case ACTION_HOLD_LAYER:
+            return VALID_INDEX(action->data.layer.index, cfg->layer_count);
+        case ACTION_GRID:
+            for (int k = 0; k <= GRID_CELLS; k++)
+                if (!VALID_INDEX(action->data.grid.keys[k], KEY_CNT + cfg->scancode_count)) return 0;
+            return 1;
+        case ACTION_MACRO:
+            return action->data.macro.first >= 0 && action->data.macro.count >= 0
+                && action->data.macro.count <= cfg->macro_step_count - action->data.macro.first;
+        case ACTION_PASSTHROUGH:
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * A cache with the right header may still be cut short or come from a build
+ * that laid config_t out the same but filled it differently. Every count and
+ * every index is checked against its table before anything follows them.
+ */
+int valid_config(const config_t* cfg)
+{
+    if (!VALID_INDEX(cfg->mapping_count, MAX_MAPPINGS + 1) || !VALID_INDEX(cfg->profile_count - 1, MAX_ACCEL_PROFILES)
+            || !VALID_INDEX(cfg->layer_count - 1, MAX_LAYERS)
+            || !VALID_INDEX(cfg->sequence_node_count - cfg->layer_count, MAX_SEQUENCE_NODES - cfg->layer_count + 1)
+            || !VALID_INDEX(cfg->scancode_count, MAX_SCANCODES + 1)
+            || !VALID_INDEX(cfg->macro_step_count, MAX_MACRO_STEPS + 1)
+            || !VALID_INDEX(cfg->device_pattern_count, MAX_DEVICE_PATTERNS + 1)
+            || !VALID_INDEX(cfg->motion_rate_hz, MAX_MOTION_RATE_HZ + 1) || cfg->motion_rate_hz == 0
+            || !VALID_STRING(cfg->lirc_device) || !VALID_STRING(cfg->warnings))
+        return 0;
+
+    int codes = KEY_CNT + cfg->scancode_count;
+    for (int i = 0; i < cfg->profile_count; i++)
+        if (!VALID_INDEX(cfg->profiles[i].params.step_count, MAX_ACCEL_STEPS + 1)) return 0;
+    for (int i = 0; i < cfg->device_pattern_count; i++)
+        if (!VALID_STRING(cfg->device_patterns[i])) return 0;
+    for (int i = 0; i < cfg->macro_step_count; i++) {
+        const macro_step_t* step = &cfg->macro_steps[i];
+        if (step->type == EV_KEY ? step->code >= KEY_CNT : step->type != EV_REL) return 0;
+    }
+    for (int i = 0; i < cfg->mapping_count; i++) {
+        const key_mapping_t* mapping = &cfg->mappings[i];
+        if (!VALID_INDEX(mapping->layer, cfg->layer_count) || !VALID_INDEX(mapping->code + 1, codes + 1)
+                || !VALID_INDEX(mapping->sequence_length, MAX_SEQUENCE_KEYS + 1) || !valid_action(cfg, &mapping->action))
+            return 0;
+        for (int k = 0; k < mapping->sequence_length; k++)
+            if (mapping->sequence[k] >= codes) return 0;
+    }
+    for (int l = 0; l < cfg->layer_count; l++) {
+        const layer_t* layer = &cfg->layers[l];
+        if (!VALID_STRING(layer->name) || !VALID_INDEX(layer->sequence_root, cfg->sequence_node_count)) return 0;
+        for (int code = 0; code < CODE_CNT; code++)
+            if (!VALID_INDEX(layer->dispatch[code] + 1, cfg->mapping_count + 1)) return 0;
+    }
+    for (int i = 0; i < cfg->sequence_node_count; i++)
+        if (!VALID_INDEX(cfg->sequence_nodes[i].mapping + 1, cfg->mapping_count + 1)) return 0;
+
+    // Every node but the roots hangs off one edge, which leaves free slots to end each probe
+    int edges = 0;
+    for (int slot = 0; slot < SEQUENCE_HASH_SIZE; slot++) {
+        const sequence_edge_t* edge = &cfg->sequence_edges[slot];
+        if (!edge->child) continue;
+        if (edge->child >= cfg->sequence_node_count || edge->parent >= cfg->sequence_node_count) return 0;
+        edges++;
+    }
+    return edges == cfg->sequence_node_count - cfg->layer_count;
+}
+
+// Map the cache if it was compiled from the YAML described by stamp
+config_t* map_config_cache(const char* cache_path, const cache_header_t* stamp)
+{
+    struct stat st;
+    size_t size = sizeof(cache_header_t) + sizeof(config_t);
+    int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size != size) { close(fd); return NULL; }
+
+    // Private and writable, runtime state such as rate limits lives in the config
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    cache_header_t* header = map;
+    config_t* cfg = (config_t*)(header + 1);
+    if (memcmp(header, stamp, sizeof(*header)) != 0 || !valid_config(cfg)) {
+        log_debug("Ignoring config cache %s, it does not match %s", cache_path, config_path);
+        munmap(map, size);
+        return NULL;
+    }
+    cfg->mapped = 1;
+    return cfg;
+}
+
+int write_config_cache(const char* cache_path, const cache_header_t* stamp, const config_t* cfg)
+{
+    char tmp_path[PATH_MAX];
+    char dir[PATH_MAX];
+
+    strcpy(dir, cache_path);
+    mkdir(dirname(dir), 0755);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    int ok = write(fd, stamp, sizeof(*stamp)) == sizeof(*stamp)
+          && write(fd, cfg, sizeof(*cfg)) == sizeof(*cfg);
+    close(fd);
+
+    // Rename over the old cache so a reader never sees half a file
+    if (!ok || rename(tmp_path, cache_path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Load config_path through the cache: map the compiled form when it matches
+ * the YAML, otherwise parse the YAML and refresh the cache. Returns NULL when
+ * the YAML cannot be loaded.
+ */
+config_t* open_config(const char* config_path, const char* cache_path)
+{
+    cache_header_t stamp;
+    uint64_t start = now_ns();
+    int stamped = stamp_config(config_path, &stamp) == 0;
+
+    if (stamped && cache_path) {
+        config_t* cfg = map_config_cache(cache_path, &stamp);
+        if (cfg) {
+            // The warnings parsing the YAML gave, it was not parsed this time
+            for (char* line = cfg->warnings; *line; ) {
+                char* end = strchr(line, '\n');
+                if (!end) break;
+                log_warn("%.*s", (int)(end - line), line);
+                line = end + 1;
+            }
+            log_info("Loaded %d key mappings from %s in %.3f ms", cfg->mapping_count, cache_path, (now_ns() - start) / 1e6);
+            return cfg;
+        }
+    }
+
+    config_t* cfg = malloc(sizeof(config_t));
+    if (!cfg) return NULL;
+    if (load_config(config_path, cfg) < 0) {
+        free(cfg);
+        return NULL;
+    }
+    if (stamped && cache_path && write_config_cache(cache_path, &stamp, cfg) < 0)
+        log_debug("Could not write config cache %s: %s", cache_path, strerror(errno));
+    return cfg;
+}
+
+void free_config(config_t* cfg)
+{
+    if (cfg->mapped) {
+        munmap((cache_header_t*)cfg - 1, sizeof(cache_header_t) + sizeof(config_t));
+    } else {
+        free(cfg);
+    }
+}
+
+/*
+ * Flight recorder: every input event handled and every event written to the
+ * virtual devices, in a ring of fixed size records in a shared mapping of
+ * FLIGHT_PATH. The pages belong to the file, so the ring survives the daemon
+ * crashing and can be copied off the device and read with --print-flight or
+ * turned into a capture with --export-flight. FLIGHT_PATH is on tmpfs, the
+ * ring is written all the time and would wear out an SD card.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity;          // records, a power of two
+    uint64_t head;              // records written since the file was created, the next goes to head % capacity
+    int64_t created;            // wall clock in seconds when the ring was set up
+} flight_header_t;
+
+typedef enum {
+    FLIGHT_START,               // the daemon started, value is the wall clock in seconds since header.created
+    FLIGHT_IN,                  // an input event, or a scancode as type EV_LIRC
+    FLIGHT_OUT                  // an event written to a virtual device
+} flight_kind_t;
+
+// What was done with an input event: an action_type_t, or one of these
+#define FLIGHT_FORWARDED 0x80
+#define FLIGHT_HELD 0x81        // held back by a sequence
+#define FLIGHT_DROPPED 0x82     // lost to an overflow of the kernel's buffer
+#define FLIGHT_IGNORED 0x83     // a scancode without a mapping
+#define FLIGHT_SWALLOWED 0x84   // the rest of a key already handled, e.g. a repeat
+
+// Device of a record: the index into devices[], or one of these
+#define FLIGHT_LIRC 0xfd
+#define FLIGHT_POINTER 0xfe     // output: the absolute pointer, 0 is the main virtual device
+#define FLIGHT_OTHER 0xff       // replay
+
+typedef struct {
+    uint64_t time;              // ns on the CLOCK_MONOTONIC of now_ns(), the input event's timestamp or the time written
+    uint16_t type;
+    uint16_t code;              // EV_LIRC: the protocol
+    int32_t value;              // EV_LIRC: the scancode, its low 32 bits
+    uint8_t kind;
+    uint8_t action;             // FLIGHT_IN: what was done with it
+    uint8_t device;
+    uint8_t flags;              // EV_LIRC: LIRC_SCANCODE_FLAG_*
+    uint32_t reserved;
+} flight_record_t;
+
+struct {
+    flight_header_t* header;    // NULL while not recording
+    flight_record_t* records;
+    flight_record_t* current;   // input event being handled, for flight_note()
+} flight;
+
+// A handful of stores, cheap enough for every event
+static inline flight_record_t* flight_add(int kind, uint64_t time, int type, int code, int value, int device)
+{
+    if (!flight.header) return NULL;
+    flight_record_t* record = &flight.records[flight.header->head & (FLIGHT_RECORDS - 1)];
+    record->time = time;
+    record->type = type;
+    record->code = code;
+    record->value = value;
+    record->kind = kind;
+    record->action = FLIGHT_FORWARDED;
+    record->device = device;
+    record->flags = 0;
+    flight.header->head++;
+    return record;
+}
+
+static inline void flight_note(int action)
+{
+    if (flight.current) flight.current->action = action;
+}
+
+/*
+ * Timestamp of ev on now_ns()'s clock, so input and output records line up.
+ * A device the kernel kept on CLOCK_REALTIME is moved over by the current
+ * offset between the two clocks, which only costs anything while recording.
+ */
+static inline uint64_t flight_time(const input_device_t* dev, const struct input_event* ev)
+{
+    uint64_t stamp = (uint64_t)ev->time.tv_sec * 1000000000ULL + (uint64_t)ev->time.tv_usec * 1000ULL;
+    if (flight.header && dev && dev->clock != CLOCK_MONOTONIC) {
+        struct timespec ts;
+        clock_gettime(dev->clock, &ts);
+        stamp += now_ns() - ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+    }
+    return stamp;
+}
+
+void lirc_ready(event_source_t* src, uint32_t events);
+
+static inline int flight_device(const input_device_t* dev)
+{
+    if (dev >= devices && dev < devices + MAX_DEVICES) return dev - devices;
+    return dev && dev->src.handle == lirc_ready ? FLIGHT_LIRC : FLIGHT_OTHER;
+}
+
+// Map the ring at path, carrying on with the records of an earlier run when it has the same layout
+void flight_open(const char* path)
+{
+    size_t size = sizeof(flight_header_t) + FLIGHT_RECORDS * sizeof(flight_record_t);
+    struct stat st;
+
+    // Everything typed on a grabbed keyboard passes through the ring, only the daemon's user may read it
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0 || fchmod(fd, 0600) < 0 || fstat(fd, &st) < 0 || ((size_t)st.st_size != size && ftruncate(fd, size) < 0)) {
+        log_warn("No flight recorder, could not open %s: %s", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return;
+    }
+    // Populated up front, recording never waits for a page fault
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_warn("No flight recorder, could not map %s: %s", path, strerror(errno));
+        return;
+    }
+
+    flight.header = map;
+    flight.records = (flight_record_t*)(flight.header + 1);
+    if (flight.header->magic != FLIGHT_MAGIC || flight.header->version != FLIGHT_VERSION
+            || flight.header->record_size != sizeof(flight_record_t) || flight.header->capacity != FLIGHT_RECORDS) {
+        memset(map, 0, size);
+        flight.header->magic = FLIGHT_MAGIC;
+        flight.header->version = FLIGHT_VERSION;
+        flight.header->record_size = sizeof(flight_record_t);
+        flight.header->capacity = FLIGHT_RECORDS;
+        flight.header->created = time(NULL);
+    }
+    // Seconds since the ring was set up fit the 32 bit value well past 2038
+    flight_add(FLIGHT_START, now_ns(), 0, 0, (int32_t)(time(NULL) - flight.header->created), FLIGHT_OTHER);
+    log_info("Flight recorder in %s", path);
+}
+
+void flight_close(void)
+{
+    if (!flight.header) return;
+    munmap(flight.header, sizeof(flight_header_t) + FLIGHT_RECORDS * sizeof(flight_record_t));
+    flight.header = NULL;
+}
+
+// Event types and codes announced by the virtual device
+typedef struct {
+    unsigned long ev[EV_CNT / BITS_PER_LONG + 1];
+    unsigned long key[KEY_CNT / BITS_PER_LONG + 1];
+    unsigned long rel[REL_CNT / BITS_PER_LONG + 1];
+    unsigned long msc[MSC_CNT / BITS_PER_LONG + 1];
+} caps_t;
+
+caps_t announced;
+caps_t unannounced;     // needed by devices or configs that came later, sent after a restart
+
+// Add what a grabbed device can send, everything it sends is forwarded
+void device_caps(int fd, caps_t* caps)
+{
+    caps_t dev;
+    memset(&dev, 0, sizeof(dev));
+    if (ioctl(fd, EVIOCGBIT(0, sizeof(dev.ev)), dev.ev) < 0) return;
+    ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(dev.key)), dev.key);
+    ioctl(fd, EVIOCGBIT(EV_REL, sizeof(dev.rel)), dev.rel);
+    ioctl(fd, EVIOCGBIT(EV_MSC, sizeof(dev.msc)), dev.msc);
+
+    // Only these types can be set up without more detail, EV_REP would make the
+    // kernel repeat keys on top of the repeats that are forwarded
+    unsigned long ev = dev.ev[0] & (1UL << EV_KEY | 1UL << EV_REL | 1UL << EV_MSC);
+    caps->ev[0] |= ev;
+    for (unsigned int i = 0; i < sizeof(dev.key) / sizeof(long); i++)
+        caps->key[i] |= (ev & 1UL << EV_KEY) ? dev.key[i] : 0;
+    for (unsigned int i = 0; i < sizeof(dev.rel) / sizeof(long); i++)
+        caps->rel[i] |= (ev & 1UL << EV_REL) ? dev.rel[i] : 0;
+    for (unsigned int i = 0; i < sizeof(dev.msc) / sizeof(long); i++)
+        caps->msc[i] |= (ev & 1UL << EV_MSC) ? dev.msc[i] : 0;
+}
+
+// Add what the mappings of cfg can send on their own
+void config_caps(const config_t* cfg, caps_t* caps)
+{
+    for (int i = 0; i < cfg->mapping_count; i++) {
+        const action_t* action = &cfg->mappings[i].action;
+        if (action->type == ACTION_KEY_COMBO) {
+            bit_set(caps->ev, EV_KEY);
+            for (int k = 0; k < action->data.combo.count; k++)
+                bit_set(caps->key, action->data.combo.keys[k]);
+        } else if (action->type == ACTION_MOVE_MOUSE) {
+            // A left button next to REL_X and REL_Y makes it a pointer to libinput
+            bit_set(caps->ev, EV_REL);
+            bit_set(caps->rel, REL_X);
+            bit_set(caps->rel, REL_Y);
+            bit_set(caps->ev, EV_KEY);
+            bit_set(caps->key, BTN_LEFT);
+        } else if (action->type == ACTION_MACRO) {
+            for (int s = 0; s < action->data.macro.count; s++) {
+                const macro_step_t* step = &cfg->macro_steps[action->data.macro.first + s];
+                bit_set(caps->ev, EV_KEY);
+                if (step->type == EV_KEY) {
+                    bit_set(caps->key, step->code);
+                } else {
+                    bit_set(caps->ev, EV_REL);
+                    bit_set(caps->rel, REL_X);
+                    bit_set(caps->rel, REL_Y);
+                    bit_set(caps->key, BTN_LEFT);
+                }
+            }
+        }
+    }
+}
+
+// Number of codes in need that have does not announce
+int caps_missing(const caps_t* have, const caps_t* need)
+{
+    const unsigned long* h = (const unsigned long*)have;
+    const unsigned long* n = (const unsigned long*)need;
+    int missing = 0;
+    for (unsigned int i = 0; i < sizeof(caps_t) / sizeof(long); i++)
+        missing += __builtin_popcountl(n[i] & ~h[i]);
+    return missing;
+}
+
+// Register exactly the bits in caps, returns the number of ioctls made
+int setup_device(int fdo, const caps_t* caps)
+{
+   struct uinput_setup usetup;
+   int calls = 0;
+
+   for (int type = 0; type < EV_CNT; type++) {
+       if (!bit_test(caps->ev, type)) continue;
+       if (ioctl(fdo, UI_SET_EVBIT, type) < 0) die("error: ioctl");
+       calls++;
+   }
+   for (int code = 0; code < KEY_CNT; code++) {
+       if (!bit_test(caps->key, code)) continue;
+       if (ioctl(fdo, UI_SET_KEYBIT, code) < 0) die("error: ioctl announce keys");
+       calls++;
+   }
+   for (int code = 0; code < REL_CNT; code++) {
+       if (!bit_test(caps->rel, code)) continue;
+       if (ioctl(fdo, UI_SET_RELBIT, code) < 0) die("error: ioctl");
+       calls++;
+   }
+   for (int code = 0; code < MSC_CNT; code++) {
+       if (!bit_test(caps->msc, code)) continue;
+       if (ioctl(fdo, UI_SET_MSCBIT, code) < 0) die("error: ioctl");
+       calls++;
+   }
+
+   memset(&usetup, 0, sizeof(usetup));
+   usetup.id.bustype = BUS_USB;
+   usetup.id.vendor = 0x1234;
+   usetup.id.product = 0x5678;
+   strcpy(usetup.name, "uinput-proxy");
+
+   if (ioctl(fdo, UI_DEV_SETUP, &usetup) < 0) die("error: ioctl");
+   if (ioctl(fdo, UI_DEV_CREATE) < 0) die("error: ioctl");
+   return calls + 2;
+}
+
+void create_uinput(const caps_t* caps)
+{
+    uint64_t start = clock_ns();
+    uinput_fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (uinput_fd < 0) die("error: open uinput");
+    int calls = setup_device(uinput_fd, caps);
+    announced = *caps;
+    log_info("Created the virtual device with %d ioctls in %.2f ms", calls, (clock_ns() - start) / 1e6);
+}
+
+void output_flush(int fd);
+void output_wait(int fd, int wait);
+
+void destroy_uinput(void)
+{
+    // Last chance for queued output, the device is gone after this
+    output_flush(uinput_fd);
+    if (output_queue.end > output_queue.start) {
+        output_stats.lost_events += output_queue.end - output_queue.start;
+        log_warn("Virtual device closed with %d events queued", output_queue.end - output_queue.start);
+        output_queue.start = output_queue.end = 0;
+        output_queue.tail_motion = -1;
+        output_wait(uinput_fd, 0);
+    }
+    if (ioctl(uinput_fd, UI_DEV_DESTROY) < 0) die("error: ioctl");
+    close(uinput_fd);
+    uinput_fd = -1;
+}
+
+/*
+ * A second virtual device with absolute X and Y for the grid action, so the
+ * pointer can be put anywhere in one event. BTN_LEFT is only announced to
+ * make it a pointer to udev and libinput, like a virtual machine's tablet,
+ * clicks still go out through the main device.
+ */
+void create_pointer(void)
+{
+    struct uinput_setup usetup;
+    struct uinput_abs_setup abs;
+
+    pointer_fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (pointer_fd < 0) die("error: open uinput");
+    if (ioctl(pointer_fd, UI_SET_EVBIT, EV_KEY) < 0 || ioctl(pointer_fd, UI_SET_KEYBIT, BTN_LEFT) < 0
+            || ioctl(pointer_fd, UI_SET_EVBIT, EV_ABS) < 0)
+        die("error: ioctl");
+    for (int axis = ABS_X; axis <= ABS_Y; axis++) {
+        memset(&abs, 0, sizeof(abs));
+        abs.code = axis;
+        abs.absinfo.maximum = GRID_RANGE - 1;
+        if (ioctl(pointer_fd, UI_ABS_SETUP, &abs) < 0) die("error: ioctl absolute axis");
+    }
+
+    memset(&usetup, 0, sizeof(usetup));
+    usetup.id.bustype = BUS_USB;
+    usetup.id.vendor = 0x1234;
+    usetup.id.product = 0x5679;
+    strcpy(usetup.name, "uinput-proxy-pointer");
+    if (ioctl(pointer_fd, UI_DEV_SETUP, &usetup) < 0) die("error: ioctl");
+    if (ioctl(pointer_fd, UI_DEV_CREATE) < 0) die("error: ioctl");
+    log_info("Created the absolute pointer device");
+}
+
+int config_has_grid(const config_t* cfg)
+{
+    for (int i = 0; i < cfg->mapping_count; i++)
+        if (cfg->mappings[i].action.type == ACTION_GRID) return 1;
+    return 0;
+}
+
+// Action and timer output, passthrough events wait in their device's frame
+frame_t out_frame;
+
+// Capture text format shared by --record, --replay and --output
+void write_capture_line(FILE* file, const struct input_event* ev)
+{
+    fprintf(file, "%ld.%06ld %u %u %d\n", (long)ev->time.tv_sec, (long)ev->time.tv_usec,
+            ev->type, ev->code, ev->value);
+}
+
+// A scancode record from a lirc device, in the same file as the input events
+void write_scancode_line(FILE* file, const struct lirc_scancode* sc)
+{
+    fprintf(file, "%llu.%06llu lirc %u 0x%llx %u\n", (unsigned long long)(sc->timestamp / 1000000000ULL),
+            (unsigned long long)(sc->timestamp % 1000000000ULL / 1000), sc->rc_proto,
+            (unsigned long long)sc->scancode, sc->flags);
+}
+
+// Events up to and including the first SYN_REPORT
+static inline int frame_length(const struct input_event* ev, int n)
+{
+    for (int i = 0; i < n; i++)
+        if (ev[i].type == EV_SYN && ev[i].code == SYN_REPORT) return i + 1;
+    return n;
+}
+
+// Whether a frame only moves the pointer, adding up its movement
+static inline int frame_motion(const struct input_event* ev, int n, int* x, int* y)
+{
+    *x = *y = 0;
+    if (ev[n - 1].type != EV_SYN || ev[n - 1].code != SYN_REPORT) return 0;
+    for (int i = 0; i < n - 1; i++) {
+        if (ev[i].type != EV_REL || (ev[i].code != REL_X && ev[i].code != REL_Y)) return 0;
+        *(ev[i].code == REL_X ? x : y) += ev[i].value;
+    }
+    return 1;
+}
+
+void output_ready(event_source_t* src, uint32_t events);
+
+static inline output_queue_t* output_queue_for(int fd)
+{
+    return fd >= 0 && fd == pointer_fd ? &pointer_queue : &output_queue;
+}
+
+// Start or stop waiting for the virtual device to become writable
+void output_wait(int fd, int wait)
+{
+    output_queue_t* q = output_queue_for(fd);
+    if (wait == (q->src.fd >= 0) || epfd < 0) return;
+    if (wait) {
+        struct epoll_event ee = {.events = EPOLLOUT, .data.ptr = &q->src};
+        q->src.fd = fd;
+        q->src.handle = output_ready;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ee) < 0) die("error: epoll_ctl");
+    } else {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, q->src.fd, NULL);
+        q->src.fd = -1;
+    }
+}
+
+// Events the kernel took, 0 when it has no room, -1 when they are lost
+int output_write(int fd, const struct input_event* ev, int n)
+{
+    ssize_t written = write(fd, ev, n * sizeof(*ev));
+    if (written >= 0) {
+        int done = written / sizeof(*ev);
+        if (flight.header) {
+            uint64_t now = now_ns();
+            for (int i = 0; i < done; i++)
+                flight_add(FLIGHT_OUT, now, ev[i].type, ev[i].code, ev[i].value, fd == pointer_fd ? FLIGHT_POINTER : 0);
+        }
+        return done;
+    }
+    if (errno == EAGAIN || errno == EINTR) return 0;
+    output_stats.errors++;
+    output_stats.lost_events += n;
+    log_error("Writing to the virtual device failed, %d events lost: %s", n, strerror(errno));
+    return -1;
+}
+
+// Write out as much of the queue as the kernel takes
+void output_flush(int fd)
+{
+    output_queue_t* q = output_queue_for(fd);
+    while (q->start < q->end) {
+        int done = output_write(fd, q->events + q->start, q->end - q->start);
+        if (done == 0) {
+            if (q->start > q->tail_motion) q->tail_motion = -1;
+            return;
+        }
+        q->start = done < 0 ? q->end : q->start + done;
+        if (q->stuck) log_warn("Virtual device taking output again, %llu events lost so far",
+                                         (unsigned long long)output_stats.lost_events);
+        q->stuck = 0;
+    }
+    q->start = q->end = 0;
+    q->tail_motion = -1;
+    output_wait(fd, 0);
+}
+
+void output_ready(event_source_t* src, uint32_t events)
+{
+    output_flush(src->fd);
+}
+
+/*
+ * Move the queue to the front of the buffer. While that leaves less than room
+ * free, the oldest frames that only move the pointer are dropped: a late
+ * movement is worth little, a lost key release leaves a key stuck.
+ */
+void output_compact(output_queue_t* q, int room)
+{
+    int queued = q->end - q->start, w = 0;
+    q->tail_motion = -1;
+    for (int r = q->start; r < q->end; ) {
+        int len = frame_length(q->events + r, q->end - r), x, y;
+        int motion = frame_motion(q->events + r, len, &x, &y);
+        if (motion && OUTPUT_QUEUE_SIZE - queued < room) {
+            queued -= len;
+            output_stats.dropped_frames++;
+            output_stats.dropped_events += len;
+        } else {
+            memmove(q->events + w, q->events + r, len * sizeof(struct input_event));
+            q->tail_motion = motion ? w : -1;
+            w += len;
+        }
+        r += len;
+    }
+    q->start = 0;
+    q->end = w;
+}
+
+/*
+ * Make room for n more events, -1 when the queue is full of keys and
+ * SYN_REPORTs. Never waits, the queue drains from the event loop on EPOLLOUT.
+ */
+int output_reserve(int fd, int n)
+{
+    output_queue_t* q = output_queue_for(fd);
+    if (q->end + n <= OUTPUT_QUEUE_SIZE) return 0;
+    // The device may have made room since the last EPOLLOUT, a write that does not fit returns at once
+    output_flush(fd);
+    output_compact(q, n);
+    if (q->end + n <= OUTPUT_QUEUE_SIZE) return 0;
+
+    output_stats.full++;
+    if (!q->stuck) log_error("Virtual device not taking output, queue full, losing events until it does");
+    q->stuck = 1;
+    return -1;
+}
+
+int output_push(int fd, const struct input_event* ev, int n)
+{
+    output_queue_t* q = output_queue_for(fd);
+    if (output_reserve(fd, n) < 0) {
+        output_stats.lost_events += n;
+        return -1;
+    }
+    memcpy(q->events + q->end, ev, n * sizeof(*ev));
+    q->end += n;
+    output_stats.queued_events += n;
+    if (q->end - q->start > output_stats.max_queued)
+        output_stats.max_queued = q->end - q->start;
+    return 0;
+}
+
+// Queue frames behind the ones already waiting, a movement right behind another is added into it
+void output_enqueue(int fd, const struct input_event* ev, int n)
+{
+    output_queue_t* q = output_queue_for(fd);
+    for (int i = 0; i < n; ) {
+        int len = frame_length(ev + i, n - i), x, y;
+        if (frame_motion(ev + i, len, &x, &y)) {
+            int tail = q->tail_motion, tail_x, tail_y;
+            if (tail >= 0) {
+                frame_motion(q->events + tail, q->end - tail, &tail_x, &tail_y);
+                q->end = tail;
+                x += tail_x;
+                y += tail_y;
+                output_stats.merged_frames++;
+            }
+            struct input_event motion[3];
+            int count = 0;
+            memset(motion, 0, sizeof(motion));
+            if (x) {
+                motion[count].type = EV_REL;
+                motion[count].code = REL_X;
+                motion[count++].value = x;
+            }
+            if (y) {
+                motion[count].type = EV_REL;
+                motion[count].code = REL_Y;
+                motion[count++].value = y;
+            }
+            motion[count].type = EV_SYN;
+            motion[count++].code = SYN_REPORT;
+            q->tail_motion = output_push(fd, motion, count) < 0 ? -1 : q->end - count;
+        } else {
+            output_push(fd, ev + i, len);
+            q->tail_motion = -1;
+        }
+        i += len;
+    }
+    output_wait(fd, 1);
+}
+
+// Write straight to the virtual device unless output is already waiting, whatever it does not take is queued
+int output_send(int fd, const struct input_event* ev, int n)
+{
+    output_queue_t* q = output_queue_for(fd);
+    if (q->start == q->end) {
+        int done = output_write(fd, ev, n);
+        if (done < 0) return -1;
+        ev += done;
+        n -= done;
+    }
+    if (n) output_enqueue(fd, ev, n);
+    return 0;
+}
+
+// Replay output, stamped with the replay clock. device is 0 or FLIGHT_POINTER like output_write() records it
+void output_record(struct input_event* ev, int n, int device)
+{
+    uint64_t now = now_ns();
+    for (int i = 0; i < n; i++) {
+        ev[i].time.tv_sec = now / 1000000000ULL;
+        ev[i].time.tv_usec = now % 1000000000ULL / 1000;
+        if (output_kind == OUTPUT_FILE) write_capture_line(output_file, &ev[i]);
+        output_ring[output_count++ % OUTPUT_RING_SIZE] = ev[i];
+        flight_add(FLIGHT_OUT, now, ev[i].type, ev[i].code, ev[i].value, device);
+    }
+}
+
+int send_frame(int fd, frame_t* frame)
+{
+    int n = frame->count;
+    frame->count = 0;
+    if (n == 0) return 0;
+    if (output_kind == OUTPUT_UINPUT) return output_send(fd, frame->events, n);
+    output_record(frame->events, n, 0);
+    return 0;
+}
+
+int write_frame(int fd)
+{
+    return send_frame(fd, &out_frame);
+}
+
+// Put the pointer at x, y in GRID_RANGE units. Queued like any other output
+// when the device has no room, so the frame always gets its SYN_REPORT
+void pointer_jump(int x, int y)
+{
+    struct input_event ev[3] = {
+        {.type = EV_ABS, .code = ABS_X, .value = x},
+        {.type = EV_ABS, .code = ABS_Y, .value = y},
+        {.type = EV_SYN, .code = SYN_REPORT, .value = 0},
+    };
+    if (output_kind != OUTPUT_UINPUT) {
+        output_record(ev, 3, FLIGHT_POINTER);
+        return;
+    }
+    if (pointer_fd >= 0) output_send(pointer_fd, ev, 3);
+}
+
+void emit(int fd, int type, int code, int val)
+{
+   if (out_frame.count == MAX_FRAME_EVENTS) write_frame(fd);
+
+   struct input_event* ie = &out_frame.events[out_frame.count++];
+   ie->type = type;
+   ie->code = code;
+   ie->value = val;
+   ie->time.tv_sec = 0;
+   ie->time.tv_usec = 0;
+}
+
+// Close the frame with a SYN_REPORT unless it already ends with one and write it out
+int flush_frame(int fd)
+{
+    if (out_frame.count == 0) return 0;
+    struct input_event* last = &out_frame.events[out_frame.count - 1];
+    if (last->type != EV_SYN || last->code != SYN_REPORT)
+        emit(fd, EV_SYN, SYN_REPORT, 0);
+    return write_frame(fd);
+}
+
+/*
+ * Queue an event from an input device in the device's own frame, which its
+ * SYN_REPORT ends, so action and timer output flushed in between never takes
+ * half of it. Without a device the event goes into out_frame, for keys that
+ * were held back and go out long after their frame.
+ */
+int forward_event(input_device_t* dev, int fd, struct input_event* ev)
+{
+    frame_t* frame = dev ? &dev->frame : &out_frame;
+    if (frame->count == MAX_FRAME_EVENTS && send_frame(fd, frame) < 0) return -1;
+    frame->events[frame->count++] = *ev;
+    if (ev->type == EV_SYN && ev->code == SYN_REPORT) return send_frame(fd, frame);
+    return 0;
+}
+
+void move_mouse(int fdo, int x, int y)
+{
+    if (x) emit(fdo, EV_REL, REL_X, x);
+    if (y) emit(fdo, EV_REL, REL_Y, y);
+    flush_frame(fdo);
+}
+
+void key_combination(int fdo, int key_count, const int key_codes[])
+{
+    int i;
+    for(i=0; i<key_count; i++) {
+        log_debug("combination key %d, key %x", i, key_codes[i]);
+        emit(fdo, EV_KEY, key_codes[i], 1);
+        emit(fdo, EV_SYN, SYN_REPORT, 0);
+    }
+    for(i=0; i<key_count-1; i++) {
+        emit(fdo, EV_KEY, key_codes[i], 0);
+        emit(fdo, EV_SYN, SYN_REPORT, 0);
+    }
+    emit(fdo, EV_KEY, key_codes[i], 0);
+    flush_frame(fdo);
+}
+
+// Time until the bucket has a run left, 0 when it has one now
+uint64_t bucket_wait(const token_bucket_t* bucket, uint64_t now)
+{
+    if (!bucket->period_ns) return 0;
+    uint64_t slack = (uint64_t)(bucket->burst - 1) * bucket->period_ns;
+    return now + slack >= bucket->full_at ? 0 : bucket->full_at - slack - now;
+}
+
+void bucket_take(token_bucket_t* bucket, uint64_t now)
+{
+    if (!bucket->period_ns) return;
+    bucket->full_at = (bucket->full_at > now ? bucket->full_at : now) + bucket->period_ns;
+}
+
+/*
+ * Realtime mode: the event loop thread runs under SCHED_FIFO, optionally pinned
+ * to some CPUs, with every page locked and the stack faulted in up front, so a
+ * held key neither waits behind a busy video decoder nor for a page fault. The
+ * hot path allocates nothing, so nothing new gets mapped once it runs. The
+ * logger thread is started before and stays a normal thread on any CPU.
+ */
+cpu_set_t start_cpus;       // affinity before realtime mode, given back to commands
+int memory_locked;
+
+void prefault_stack(void)
+{
+    char stack[PREFAULT_STACK];
+    memset(stack, 0, sizeof(stack));
+    __asm__ volatile("" : : "r"(stack) : "memory");     // keep the stores
+}
+
+void apply_realtime(const config_t* cfg)
+{
+    static int saved;
+    if (!saved) {
+        saved = 1;
+        if (sched_getaffinity(0, sizeof(start_cpus), &start_cpus) < 0) CPU_ZERO(&start_cpus);
+    }
+
+    // Only the calling thread, and commands started from it go back to a normal policy
+    struct sched_param param = {.sched_priority = cfg->realtime_priority};
+    int policy = cfg->realtime_priority ? SCHED_FIFO | SCHED_RESET_ON_FORK : SCHED_OTHER;
+    if (sched_setscheduler(0, policy, &param) < 0)
+        log_warn("Cannot set realtime priority %d: %s", cfg->realtime_priority, strerror(errno));
+
+    cpu_set_t cpus = start_cpus;
+    if (cfg->cpu_affinity) {
+        CPU_ZERO(&cpus);
+        for (int cpu = 0; cpu < 64; cpu++)
+            if (cfg->cpu_affinity & (1ULL << cpu)) CPU_SET(cpu, &cpus);
+    }
+    if (CPU_COUNT(&cpus) && sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+        log_warn("Cannot set CPU affinity: %s", strerror(errno));
+
+    if (cfg->realtime_priority && !memory_locked) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            log_warn("Cannot lock memory: %s", strerror(errno));
+        } else {
+            memory_locked = 1;
+            prefault_stack();
+        }
+    } else if (!cfg->realtime_priority && memory_locked) {
+        munlockall();
+        memory_locked = 0;
+    }
+    if (cfg->realtime_priority)
+        log_info("Realtime priority %d%s", cfg->realtime_priority, memory_locked ? ", memory locked" : "");
+}
+
+typedef struct {
+    pid_t pid;
+    uint64_t started_at;
+    char command[64];       // for logging, the config may be reloaded while it runs
+    action_t* action;       // counted in its max_instances, NULL for internal commands
+} child_t;
+
+child_t children[MAX_CHILDREN];
+extern char** environ;
+
+// Start argv in the background, reap_children() collects it. label is for logging
+int spawn_command(char* const argv[], const char* label, action_t* action)
+{
+    // The daemon blocks the signals it reads through its signalfd, children should not
+    posix_spawnattr_t attr;
+    sigset_t empty;
+    sigemptyset(&empty);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    pid_t pid;
+    uint64_t start = now_ns();
+    int err = posix_spawnp(&pid, argv[0], NULL, &attr, argv, environ);
+    uint64_t launched = now_ns();
+    posix_spawnattr_destroy(&attr);
+    if (err) {
+        log_error("Could not execute %s: %s", label, strerror(err));
+        return -1;
+    }
+    log_debug("Started pid %d in %.3f ms", pid, (launched - start) / 1e6);
+    // Affinity is inherited and posix_spawn can not set it, undo it right after
+    if (config && config->cpu_affinity && CPU_COUNT(&start_cpus))
+        sched_setaffinity(pid, sizeof(start_cpus), &start_cpus);
+
+    for (int i = 0; i < MAX_CHILDREN; i++) {
+        if (children[i].pid == 0) {
+            children[i].pid = pid;
+            children[i].started_at = launched;
+            snprintf(children[i].command, sizeof(children[i].command), "%.*s", (int)sizeof(children[i].command) - 1, label);
+            children[i].action = action;
+            if (action) action->data.exec.running++;
+            break;
+        }
+    }
+    return 0;
+}
+
+// maxInstances is only kept for children in the table, so a full table counts as busy
+int child_slot_free(void)
+{
+    for (int i = 0; i < MAX_CHILDREN; i++)
+        if (children[i].pid == 0) return 1;
+    return 0;
+}
+
+int launch_command(action_t* action)
+{
+    log_info("Executing: %s", action->data.exec.command);
+    if (replaying) return 0;
+
+    char* argv[MAX_ARGS + 3];
+    int argc = 0;
+    if (action->data.exec.shell > 0) {
+        argv[argc++] = "/bin/sh";
+        argv[argc++] = "-c";
+        argv[argc++] = action->data.exec.command;
+    } else {
+        for (int i = 0; i < action->data.exec.arg_count; i++)
+            argv[argc++] = action->data.exec.args + action->data.exec.arg_offsets[i];
+    }
+    argv[argc] = NULL;
+    return spawn_command(argv, action->data.exec.command, action);
+}
+
+void execute_command(action_t* action)
+{
+    uint64_t now = now_ns();
+    uint64_t wait = bucket_wait(&action->data.exec.interval, now);
+    uint64_t wait_rate = bucket_wait(&action->data.exec.per_second, now);
+    if (wait_rate > wait) wait = wait_rate;
+    if (wait) {
+        log_info("Rate limit: command blocked, wait %.2f more seconds: %s", wait / 1e9, action->data.exec.command);
+        return;
+    }
+
+    if (action->data.exec.max_instances
+            && (action->data.exec.running >= action->data.exec.max_instances || !child_slot_free())) {
+        int room = action->data.exec.busy == BUSY_QUEUE ? action->data.exec.queue_size
+                 : action->data.exec.busy == BUSY_COALESCE ? 1 : 0;
+        if (action->data.exec.queued >= room) {
+            log_info("Busy: %d running, dropped: %s", action->data.exec.running, action->data.exec.command);
+            return;
+        }
+        action->data.exec.queued++;
+        log_info("Busy: %d running, queued as %d: %s", action->data.exec.running, action->data.exec.queued,
+                 action->data.exec.command);
+    } else {
+        launch_command(action);
+    }
+    // A queued run counts against the rate when it is accepted, not when it starts
+    bucket_take(&action->data.exec.interval, now);
+    bucket_take(&action->data.exec.per_second, now);
+}
+
+// Collect every exited child, SIGCHLD is coalesced so one signal may stand for several
+void reap_children(void)
+{
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < MAX_CHILDREN; i++) {
+            if (children[i].pid != pid) continue;
+            log_write(!WIFEXITED(status) || WEXITSTATUS(status) ? LEVEL_WARN : LEVEL_DEBUG,
+                      "Command %s (pid %d) %s %d after %.1f ms", children[i].command, pid,
+                      WIFEXITED(status) ? "exited with" : "killed by signal",
+                      WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status),
+                      (now_ns() - children[i].started_at) / 1e6);
+            if (children[i].action) children[i].action->data.exec.running--;
+            memset(&children[i], 0, sizeof(children[i]));
+            break;
+        }
+    }
+
+    // Queued runs wait for an instance of their own or, with the table full, any slot
+    for (int i = 0; i < config->mapping_count; i++) {
+        action_t* action = &config->mappings[i].action;
+        if (action->type != ACTION_EXECUTE) continue;
+        while (action->data.exec.queued && action->data.exec.running < action->data.exec.max_instances
+                && child_slot_free()) {
+            action->data.exec.queued--;
+            launch_command(action);
+        }
+    }
+}
+
+// Keep the instance counts, queues and rate limits of commands that survive a
+// reload, matched by mapping index and command. Others start over
+void exec_rebind(config_t* prev, config_t* next)
+{
+    for (int i = 0; i < next->mapping_count && i < prev->mapping_count; i++) {
+        action_t* from = &prev->mappings[i].action;
+        action_t* to = &next->mappings[i].action;
+        if (from->type != ACTION_EXECUTE || to->type != ACTION_EXECUTE
+                || strcmp(from->data.exec.command, to->data.exec.command)) continue;
+        to->data.exec.running = from->data.exec.running;
+        to->data.exec.queued = from->data.exec.queued;
+        to->data.exec.interval.full_at = from->data.exec.interval.full_at;
+        to->data.exec.per_second.full_at = from->data.exec.per_second.full_at;
+    }
+    for (int i = 0; i < MAX_CHILDREN; i++) {
+        if (!children[i].action) continue;
+        int index = (key_mapping_t*)((char*)children[i].action - offsetof(key_mapping_t, action)) - prev->mappings;
+        action_t* to = index < next->mapping_count ? &next->mappings[index].action : NULL;
+        children[i].action = to && to->type == ACTION_EXECUTE
+                && !strcmp(to->data.exec.command, children[i].action->data.exec.command) ? to : NULL;
+    }
+}
+
+void epoll_add(event_source_t* src)
+{
+    struct epoll_event ee = {.events = EPOLLIN, .data.ptr = src};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, src->fd, &ee) < 0) die("error: epoll_ctl");
+}
+
+void timer_ready(event_source_t* src, uint32_t events);
+
+void timer_init(timer_source_t* timer, void (*expired)(timer_source_t* timer))
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->expired = expired;
+    timer->src.fd = -1;
+    if (!replaying) {
+        timer->src.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer->src.fd < 0) die("error: timerfd_create");
+        timer->src.handle = timer_ready;
+        epoll_add(&timer->src);
+    }
+    if (timer_count == MAX_TIMERS) die("error: too many timers");
+    timers[timer_count++] = timer;
+}
+
+// Expire after delay_ns and then every interval_ns, a delay of 0 disarms
+void timer_arm(timer_source_t* timer, uint64_t delay_ns, uint64_t interval_ns)
+{
+    timer->deadline = delay_ns ? now_ns() + delay_ns : 0;
+    timer->interval = delay_ns ? interval_ns : 0;
+    if (timer->src.fd < 0) return;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = delay_ns / 1000000000ULL;
+    its.it_value.tv_nsec = delay_ns % 1000000000ULL;
+    its.it_interval.tv_sec = timer->interval / 1000000000ULL;
+    its.it_interval.tv_nsec = timer->interval % 1000000000ULL;
+    if (timerfd_settime(timer->src.fd, 0, &its, NULL) < 0) die("error: timerfd_settime");
+}
+
+void timer_disarm(timer_source_t* timer)
+{
+    if (timer->deadline) timer_arm(timer, 0, 0);
+}
+
+void timer_fire(timer_source_t* timer)
+{
+    timer->deadline = timer->interval ? timer->deadline + timer->interval : 0;
+    timer->expired(timer);
+}
+
+void timer_ready(event_source_t* src, uint32_t events)
+{
+    timer_source_t* timer = (timer_source_t*)src;
+    uint64_t expirations;
+    if (read(src->fd, &expirations, sizeof(expirations)) < 0) return;
+    if (timer->interval && expirations > 1) timer->deadline += (expirations - 1) * timer->interval;
+    timer_fire(timer);
+}
+
+// Replay: run every timer that expires before the next captured event, in deadline order
+void run_due_timers(uint64_t until)
+{
+    for (;;) {
+        timer_source_t* next = NULL;
+        for (int i = 0; i < timer_count; i++) {
+            if (timers[i]->deadline && timers[i]->deadline <= until
+                    && (!next || timers[i]->deadline < next->deadline))
+                next = timers[i];
+        }
+        if (!next) break;
+        replay_clock = next->deadline;
+        timer_fire(next);
+    }
+    replay_clock = until;
+}
+
+// Velocity in 16.16 pixels per second for a key held since pressed_at
+static inline uint32_t motion_velocity(const motion_key_t* key, uint64_t now)
+{
+    uint64_t step = (now - key->pressed_at) / (ACCEL_STEP_MS * 1000000ULL);
+    return key->profile->velocity[step < ACCEL_LUT_SIZE ? step : ACCEL_LUT_SIZE - 1];
+}
+
+void motion_emit(uint64_t now)
+{
+    int64_t vx = 0, vy = 0;
+    for (int i = 0; i < motion.count; i++) {
+        uint32_t v = motion_velocity(&motion.keys[i], now);
+        vx += motion.keys[i].x * (int64_t)v;
+        vy += motion.keys[i].y * (int64_t)v;
+    }
+
+    // Integrate over the real time since the last tick, keeping the fraction for the next one
+    uint64_t elapsed = now - motion.last_tick;
+    if (elapsed > 100000000ULL) elapsed = 100000000ULL;     // don't jump after a stall
+    motion.last_tick = now;
+    motion.remainder_x += vx * (int64_t)elapsed / 1000000000LL;
+    motion.remainder_y += vy * (int64_t)elapsed / 1000000000LL;
+    int x = (int)(motion.remainder_x / 65536);
+    int y = (int)(motion.remainder_y / 65536);
+    motion.remainder_x -= (int64_t)x * 65536;
+    motion.remainder_y -= (int64_t)y * 65536;
+    if (x || y) move_mouse(uinput_fd, x, y);
+}
+
+void motion_tick(timer_source_t* timer)
+{
+    if (motion.count) motion_emit(now_ns());
+}
+
+void motion_press(input_device_t* dev, int code, int x, int y, const accel_profile_t* profile)
+{
+    for (int i = 0; i < motion.count; i++)
+        if (motion.keys[i].code == code) return;
+    if (motion.count == MAX_MOTION_KEYS) return;
+
+    uint64_t now = now_ns();
+    motion_key_t* key = &motion.keys[motion.count++];
+    key->dev = dev;
+    key->code = code;
+    key->x = x < 0 ? -1 : x > 0;
+    key->y = y < 0 ? -1 : y > 0;
+    key->profile = profile;
+    key->pressed_at = now;
+
+    // Move one tick's worth straight away, the timer takes over for as long as the key is held
+    if (motion.count == 1) {
+        uint64_t period = 1000000000ULL / config->motion_rate_hz;
+        motion.last_tick = now - period;
+        motion.remainder_x = motion.remainder_y = 0;
+        timer_arm(&motion.timer, period, period);
+    }
+    motion_emit(now);
+}
+
+void motion_release(int code)
+{
+    for (int i = 0; i < motion.count; i++) {
+        if (motion.keys[i].code == code) {
+            motion.keys[i] = motion.keys[--motion.count];
+            break;
+        }
+    }
+    if (motion.count == 0) timer_disarm(&motion.timer);
+}
+
+// After a reload, point held keys at their new mappings, or drop them when they changed
+void motion_rebind(void)
+{
+    for (int i = motion.count - 1; i >= 0; i--) {
+        key_mapping_t* mapping = lookup_mapping(motion.keys[i].code);
+        if (mapping && mapping->action.type == ACTION_MOVE_MOUSE) {
+            motion.keys[i].profile = &config->profiles[mapping->action.data.mouse.profile];
+        } else {
+            motion_release(motion.keys[i].code);
+        }
+    }
+}
+
+static inline int histogram_bucket(uint64_t value)
+{
+    if (value < (1 << HIST_SUB_BITS)) return value;
+    int msb = 63 - __builtin_clzll(value);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+         | ((value >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+// Smallest value that lands in the bucket after b
+uint64_t histogram_upper(int b)
+{
+    if (b + 1 < (1 << HIST_SUB_BITS)) return b + 1;
+    b++;
+    int msb = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    return (1ULL << msb) | ((uint64_t)(b & ((1 << HIST_SUB_BITS) - 1)) << (msb - HIST_SUB_BITS));
+}
+
+static inline void histogram_add(histogram_t* h, uint64_t value)
+{
+    h->buckets[histogram_bucket(value)]++;
+    h->count++;
+    if (value > h->max) h->max = value;
+}
+
+// A handful of stores, no locks or allocation, fine for every event
+static inline void record_latency(latency_kind_t kind, input_device_t* dev, const struct input_event* ev)
+{
+    uint64_t now;
+    if (dev && dev->clock != CLOCK_MONOTONIC) {
+        struct timespec ts;
+        clock_gettime(dev->clock, &ts);
+        now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    } else {
+        now = now_ns();
+    }
+    uint64_t stamp = (uint64_t)ev->time.tv_sec * 1000000000ULL + (uint64_t)ev->time.tv_usec * 1000ULL;
+    uint64_t age = now > stamp ? now - stamp : 0;
+
+    histogram_add(&latency[kind], age);
+}
+
+uint64_t histogram_percentile(const histogram_t* h, int percent)
+{
+    uint64_t target = (h->count * percent + 99) / 100, seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= target) return histogram_upper(b) < h->max ? histogram_upper(b) : h->max;
+    }
+    return h->max;
+}
+
+void reply_printf(reply_t* reply, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void reply_printf(reply_t* reply, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(reply->data + reply->len, sizeof(reply->data) - reply->len, fmt, args);
+    va_end(args);
+    if (n > 0) reply->len += (size_t)n < sizeof(reply->data) - reply->len ? (size_t)n : sizeof(reply->data) - reply->len - 1;
+}
+
+void format_stats(reply_t* reply)
+{
+    reply_printf(reply, "Latency from input to output (us):\n");
+    for (int kind = 0; kind < LATENCY_KINDS; kind++) {
+        histogram_t* h = &latency[kind];
+        if (!h->count) continue;
+        reply_printf(reply, "  %-12s %8llu events  p50 %9.1f  p99 %9.1f  max %9.1f\n", latency_names[kind],
+                     (unsigned long long)h->count, histogram_percentile(h, 50) / 1e3,
+                     histogram_percentile(h, 99) / 1e3, h->max / 1e3);
+    }
+    if (input_stats.reads) {
+        reply_printf(reply, "Input: %llu events in %llu reads, %llu merged in %llu frames, %llu overflows dropped %llu\n",
+                     (unsigned long long)input_stats.events, (unsigned long long)input_stats.reads,
+                     (unsigned long long)input_stats.merged_events, (unsigned long long)input_stats.merged_frames,
+                     (unsigned long long)input_stats.overflows, (unsigned long long)input_stats.dropped_events);
+    }
+    if (output_stats.queued_events || output_stats.lost_events) {
+        reply_printf(reply, "Output: %llu events queued (at most %d), %llu movements merged, %llu dropped, queue full %llu times, %llu events lost\n",
+                     (unsigned long long)output_stats.queued_events, output_stats.max_queued,
+                     (unsigned long long)output_stats.merged_frames, (unsigned long long)output_stats.dropped_frames,
+                     (unsigned long long)output_stats.full, (unsigned long long)output_stats.lost_events);
+    }
+    if (macros.started) {
+        histogram_t* h = &macros.lateness;
+        reply_printf(reply, "Macros: %llu played, %llu ignored, %llu steps late by p50 %.1f p99 %.1f max %.1f us\n",
+                     (unsigned long long)macros.started, (unsigned long long)macros.dropped,
+                     (unsigned long long)h->count, histogram_percentile(h, 50) / 1e3,
+                     histogram_percentile(h, 99) / 1e3, h->max / 1e3);
+    }
+    // Should stay put in realtime mode once the daemon is running
+    struct rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) == 0)
+        reply_printf(reply, "Page faults: %ld minor, %ld major\n", usage.ru_minflt, usage.ru_majflt);
+}
+
+void dump_stats(void)
+{
+    static reply_t stats;
+    stats.len = 0;
+    format_stats(&stats);
+    for (char* line = strtok(stats.data, "\n"); line; line = strtok(NULL, "\n"))
+        log_info("%s", line);
+}
+
+void stats_tick(timer_source_t* timer)
+{
+    dump_stats();
+}
+
+void combo_repeat_stop(void)
+{
+    combo_repeat.code = -1;
+    timer_disarm(&combo_repeat.timer);
+}
+
+void combo_repeat_start(input_device_t* dev, const action_t* action, int code)
+{
+    combo_repeat.code = code;
+    combo_repeat.dev = dev;
+    combo_repeat.action = action;
+    combo_repeat.last_seen = now_ns();
+    timer_arm(&combo_repeat.timer, action->data.combo.repeat_delay_ms * 1000000ULL,
+              action->data.combo.repeat_rate_ms * 1000000ULL);
+}
+
+void combo_repeat_tick(timer_source_t* timer)
+{
+    const action_t* action = combo_repeat.action;
+    if (action->data.combo.repeat_timeout_ms
+            && now_ns() - combo_repeat.last_seen > action->data.combo.repeat_timeout_ms * 1000000ULL) {
+        // The release got lost, a remote keeps sending repeats while a key is held
+        log_debug("No repeat from keycode 0x%x, stopping", combo_repeat.code);
+        combo_repeat_stop();
+        return;
+    }
+    key_combination(uinput_fd, action->data.combo.count, action->data.combo.keys);
+}
+
+/*
+ * Grid jump mode, started by a grid action. The pointer jumps to the middle
+ * of the screen, and every cell key jumps it to the middle of that cell of a
+ * 3x3 grid over the current cell, which becomes the cell the next key
+ * subdivides. Four presses narrow a 1920 pixel wide screen down to 24 pixels.
+ * The finish key, or any key that is not part of the grid, ends the mode and
+ * the digits move the pointer relatively again.
+ */
+struct {
+    int active;
+    input_device_t* dev;        // device whose key started the mode
+    int keys[GRID_CELLS + 1];   // copied from the action, it goes away on reload
+    unsigned int held;          // grid keys pressed in the mode, their repeats and releases are swallowed
+    input_device_t* held_by[GRID_CELLS + 1];    // device each held key is held on
+    int x, y, w, h;             // current cell in GRID_RANGE units
+    int depth;
+} grid;
+
+void grid_jump(void)
+{
+    log_debug("Grid cell %d,%d %dx%d", grid.x, grid.y, grid.w, grid.h);
+    pointer_jump(grid.x + grid.w / 2, grid.y + grid.h / 2);
+}
+
+void grid_start(input_device_t* dev, const action_t* action)
+{
+    grid.dev = dev;
+    memcpy(grid.keys, action->data.grid.keys, sizeof(grid.keys));
+    grid.active = 1;
+    grid.x = grid.y = 0;
+    grid.w = grid.h = GRID_RANGE;
+    grid.depth = 0;
+    grid_jump();
+}
+
+void grid_stop(void)
+{
+    if (grid.active) log_debug("Grid done after %d cells", grid.depth);
+    grid.active = 0;
+}
+
+// Returns 1 when the grid took the key
+int grid_key(input_device_t* dev, const struct input_event* ev)
+{
+    int index = -1;
+    for (int i = 0; i <= GRID_CELLS && index < 0; i++)
+        if (grid.keys[i] == ev->code) index = i;
+    unsigned int bit = index >= 0 ? 1U << index : 0;
+
+    if (ev->value != 1) {
+        if (!(grid.held & bit)) return 0;
+        if (ev->value == 0) grid.held &= ~bit;
+        return 1;
+    }
+    if (!grid.active) return 0;
+    if (index < 0) {
+        // Does what it always does
+        grid_stop();
+        return 0;
+    }
+    grid.held |= bit;
+    grid.held_by[index] = dev;
+    if (index == GRID_CELLS) {
+        grid_stop();
+        return 1;
+    }
+
+    // Cell edges are rounded the same way from both sides, so the cells tile the parent
+    int column = index % 3, row = index / 3;
+    int x = grid.x + grid.w * column / 3, y = grid.y + grid.h * row / 3;
+    grid.w = grid.x + grid.w * (column + 1) / 3 - x;
+    grid.h = grid.y + grid.h * (row + 1) / 3 - y;
+    grid.x = x;
+    grid.y = y;
+    grid.depth++;
+    grid_jump();
+    return 1;
+}
+
+/*
+ * Macros play from one timer, a step at a time, so input keeps flowing
+ * between the steps and several macros can play at once. Every step is due
+ * at its planned time counted from the press, a late step does not push back
+ * the ones after it, and how late the steps went out is kept for the stats.
+ */
+void macro_play(macro_player_t* player, uint64_t now)
+{
+    while (player->step && player->due <= now) {
+        const macro_step_t* step = player->step++;
+        histogram_add(&macros.lateness, now - player->due);
+        if (step->type == EV_REL) {
+            move_mouse(uinput_fd, step->value, step->y);
+        } else {
+            emit(uinput_fd, EV_KEY, step->code, step->value);
+            flush_frame(uinput_fd);
+        }
+        if (player->step == player->end) player->step = NULL;
+        else player->due += player->step->delay_ms * 1000000ULL;
+    }
+}
+
+void macro_schedule(uint64_t now)
+{
+    uint64_t next = 0;
+    for (int i = 0; i < MAX_RUNNING_MACROS; i++) {
+        const macro_player_t* player = &macros.players[i];
+        if (player->step && (!next || player->due < next)) next = player->due;
+    }
+    if (next) timer_arm(&macros.timer, next > now ? next - now : 1, 0);
+    else timer_disarm(&macros.timer);
+}
+
+void macro_tick(timer_source_t* timer)
+{
+    uint64_t now = now_ns();
+    for (int i = 0; i < MAX_RUNNING_MACROS; i++)
+        macro_play(&macros.players[i], now);
+    macro_schedule(now);
+}
+
+void macro_start(const action_t* action)
+{
+    macro_player_t* player = NULL;
+    for (int i = 0; i < MAX_RUNNING_MACROS && !player; i++)
+        if (!macros.players[i].step) player = &macros.players[i];
+    if (!player) {
+        macros.dropped++;
+        log_warn("%d macros playing already, ignoring the press", MAX_RUNNING_MACROS);
+        return;
+    }
+
+    uint64_t now = now_ns();
+    macros.started++;
+    player->step = &config->macro_steps[action->data.macro.first];
+    player->end = player->step + action->data.macro.count;
+    player->due = now + player->step->delay_ms * 1000000ULL;
+    // A first step without a delay goes out right away, not after a trip through the timer
+    macro_play(player, now);
+    macro_schedule(now);
+}
+
+// The steps belong to the config, cut every macro short and release the keys it still holds
+void macro_stop_all(void)
+{
+    for (int i = 0; i < MAX_RUNNING_MACROS; i++) {
+        macro_player_t* player = &macros.players[i];
+        for (; player->step && player->step < player->end; player->step++) {
+            if (player->step->type == EV_KEY && player->step->value == 0)
+                emit(uinput_fd, EV_KEY, player->step->code, 0);
+        }
+        player->step = NULL;
+    }
+    flush_frame(uinput_fd);
+    timer_disarm(&macros.timer);
+}
+
+void set_layer(int index)
+{
+    if (active_layer == &config->layers[index]) return;
+    active_layer = &config->layers[index];
+    log_info("Layer %s", active_layer->name);
+    // Held move_mouse keys stop unless the new layer moves them too
+    motion_rebind();
+}
+
+// Run the action mapped to a key, returns 0 when the key should be forwarded instead
+int run_action(input_device_t* dev, action_t* action, struct input_event* ev)
+{
+    int current = active_layer - config->layers;
+    switch (action->type) {
+        case ACTION_MOVE_MOUSE:
+            // Repeats are ignored, the motion timer drives the cursor while held
+            if (ev->value == 1) {
+                motion_press(dev, ev->code, action->data.mouse.x, action->data.mouse.y,
+                             &config->profiles[action->data.mouse.profile]);
+                record_latency(LATENCY_MOUSE, dev, ev);
+            } else if (ev->value == 0) {
+                motion_release(ev->code);
+            }
+            return 1;
+        case ACTION_KEY_COMBO:
+            // Once on press, repeats come from combo_repeat while the key is held
+            if (ev->value == 1) {
+                key_combination(uinput_fd, action->data.combo.count, action->data.combo.keys);
+                record_latency(LATENCY_COMBO, dev, ev);
+                if (action->data.combo.repeat_rate_ms) combo_repeat_start(dev, action, ev->code);
+            }
+            return 1;
+        case ACTION_EXECUTE:
+            // Only execute on key press (value == 1), not on repeat or release
+            if (ev->value == 1) {
+                execute_command(action);
+                record_latency(LATENCY_EXEC, dev, ev);
+            }
+            return 1;
+        case ACTION_SWITCH_LAYER:
+            if (ev->value == 1) set_layer(action->data.layer.index);
+            return 1;
+        case ACTION_TOGGLE_LAYER:
+            if (ev->value != 1) return 1;
+            if (current == action->data.layer.index) {
+                set_layer(layer_return.toggled_from);
+            } else {
+                layer_return.toggled_from = current;
+                set_layer(action->data.layer.index);
+            }
+            return 1;
+        case ACTION_HOLD_LAYER:
+            // Released in dispatch_key(), whatever the key maps to in the held layer
+            if (ev->value == 1 && layer_return.hold_code < 0) {
+                layer_return.hold_code = ev->code;
+                layer_return.held_from = current;
+                layer_return.hold_dev = dev;
+                set_layer(action->data.layer.index);
+            }
+            return 1;
+        case ACTION_GRID:
+            if (ev->value == 1) grid_start(dev, action);
+            return 1;
+        case ACTION_MACRO:
+            if (ev->value == 1) macro_start(action);
+            return 1;
+        case ACTION_PASSTHROUGH:
+            break;
+    }
+    return 0;
+}
+
+void dispatch_key(input_device_t* dev, struct input_event* ev)
+{
+    if ((int)ev->code == combo_repeat.code && ev->value != 1) {
+        if (ev->value == 0) combo_repeat_stop();
+        else combo_repeat.last_seen = now_ns();
+        flight_note(ACTION_KEY_COMBO);
+        return;
+    }
+    if (combo_repeat.code >= 0 && ev->value == 1) combo_repeat_stop();
+
+    if ((int)ev->code == layer_return.hold_code && ev->value != 1) {
+        if (ev->value == 0) {
+            layer_return.hold_code = -1;
+            set_layer(layer_return.held_from);
+        }
+        flight_note(ACTION_HOLD_LAYER);
+        return;
+    }
+
+    // A key forwarded as pressed is forwarded until it is released, even when the layer changed since
+    unsigned long bit = 1UL << (ev->code % BITS_PER_LONG);
+    int forwarded = dev && ev->code < KEY_CNT && ev->value != 1 && (dev->keys_down[ev->code / BITS_PER_LONG] & bit);
+    key_mapping_t* mapping = forwarded ? NULL : lookup_mapping(ev->code);
+    if (mapping && run_action(dev, &mapping->action, ev)) {
+        flight_note(mapping->action.type);
+        return;
+    }
+    if (ev->code >= KEY_CNT) {
+        // A scancode has no key to forward
+        flight_note(FLIGHT_IGNORED);
+        return;
+    }
+
+    if (dev && ev->code < KEY_CNT) {
+        if (ev->value) dev->keys_down[ev->code / BITS_PER_LONG] |= bit;
+        else dev->keys_down[ev->code / BITS_PER_LONG] &= ~bit;
+    }
+    forward_event(sequence.resolving ? NULL : dev, uinput_fd, ev);
+}
+
+void sequence_feed(input_device_t* dev, struct input_event* ev);
+
+void sequence_reset(void)
+{
+    sequence.count = 0;
+    timer_disarm(&sequence.timer);
+}
+
+/*
+ * The keys held back so far do not continue into a longer sequence. Fire the
+ * longest sequence they start with, or dispatch the first key as usual, and
+ * feed whatever follows back through the matcher in the original order.
+ */
+void sequence_resolve(void)
+{
+    pending_key_t pending[MAX_SEQUENCE_PENDING];
+    int count = sequence.count;
+    memcpy(pending, sequence.pending, count * sizeof(pending[0]));
+    // The keys handled here were recorded as held, not the key being handled now
+    flight_record_t* current = flight.current;
+    flight.current = NULL;
+
+    int resolving = sequence.resolving;
+    sequence.resolving = 1;
+
+    // Walk the presses down the trie again, remembering the last node with a mapping
+    int node = active_layer->sequence_root, mapping = -1, used = 1;
+    for (int i = 0; i < count && node >= 0; i++) {
+        if (pending[i].ev.value != 1) continue;
+        node = sequence_child(config, node, pending[i].ev.code);
+        if (node >= 0 && config->sequence_nodes[node].mapping >= 0) {
+            mapping = config->sequence_nodes[node].mapping;
+            used = i + 1;
+        }
+    }
+    // Releases and repeats up to the next press belong to the keys that were used
+    while (used < count && pending[used].ev.value != 1) used++;
+    sequence_reset();
+
+    if (mapping >= 0) {
+        struct input_event* last = NULL;
+        for (int i = 0; i < used; i++) {
+            unsigned long bit = 1UL << (pending[i].ev.code % BITS_PER_LONG);
+            if (pending[i].ev.value == 1) {
+                sequence.swallow[pending[i].ev.code / BITS_PER_LONG] |= bit;
+                last = &pending[i].ev;
+            } else if (pending[i].ev.value == 0) {
+                sequence.swallow[pending[i].ev.code / BITS_PER_LONG] &= ~bit;
+            }
+        }
+        log_debug("Sequence ending with keycode 0x%x", last->code);
+        run_action(pending[used - 1].dev, &config->mappings[mapping].action, last);
+    } else {
+        for (int i = 0; i < used; i++) {
+            dispatch_key(pending[i].dev, &pending[i].ev);
+            flush_frame(uinput_fd);
+        }
+    }
+    for (int i = used; i < count; i++) {
+        sequence_feed(pending[i].dev, &pending[i].ev);
+        flush_frame(uinput_fd);
+    }
+    sequence.resolving = resolving;
+    flight.current = current;
+}
+
+// Key events go through here while the config has sequences, one hash probe per press
+void sequence_feed(input_device_t* dev, struct input_event* ev)
+{
+    unsigned long bit = 1UL << (ev->code % BITS_PER_LONG);
+    unsigned long* swallowed = &sequence.swallow[ev->code / BITS_PER_LONG];
+
+    // The rest of a key that completed a sequence
+    if (ev->value != 1 && (*swallowed & bit)) {
+        if (ev->value == 0) *swallowed &= ~bit;
+        flight_note(FLIGHT_SWALLOWED);
+        return;
+    }
+    *swallowed &= ~bit;
+
+    if (ev->value == 1) {
+        int child = sequence_child(config, sequence.count ? sequence.node : active_layer->sequence_root, ev->code);
+        if (child < 0 && sequence.count == 0) {
+            dispatch_key(dev, ev);
+            return;
+        }
+        if (child < 0 || sequence.count == MAX_SEQUENCE_PENDING) {
+            sequence_resolve();
+            sequence_feed(dev, ev);
+            return;
+        }
+        sequence.pending[sequence.count].dev = dev;
+        sequence.pending[sequence.count++].ev = *ev;
+        flight_note(FLIGHT_HELD);
+        sequence.node = child;
+        if (config->sequence_nodes[child].children == 0) {
+            sequence_resolve();
+        } else {
+            timer_arm(&sequence.timer, config->sequence_timeout_ms * 1000000ULL, 0);
+        }
+        return;
+    }
+
+    if (sequence.count == 0) {
+        dispatch_key(dev, ev);
+    } else if (sequence.count == MAX_SEQUENCE_PENDING) {
+        sequence_resolve();
+        sequence_feed(dev, ev);
+    } else {
+        sequence.pending[sequence.count].dev = dev;
+        sequence.pending[sequence.count++].ev = *ev;
+        flight_note(FLIGHT_HELD);
+    }
+}
+
+void sequence_tick(timer_source_t* timer)
+{
+    sequence_resolve();
+    flush_frame(uinput_fd);
+}
+
+// Held back keys of a device that went away are dropped, nothing would release them
+void sequence_forget(input_device_t* dev)
+{
+    for (int i = 0; i < sequence.count; i++) {
+        if (sequence.pending[i].dev == dev) {
+            sequence_reset();
+            return;
+        }
+    }
+}
+
+// Nothing will release the keys of a device that went away, end the hold layer and grid they keep going
+void hold_forget(input_device_t* dev)
+{
+    if (layer_return.hold_code >= 0 && layer_return.hold_dev == dev) {
+        layer_return.hold_code = -1;
+        set_layer(layer_return.held_from);
+    }
+    for (int i = 0; i <= GRID_CELLS; i++)
+        if ((grid.held & 1U << i) && grid.held_by[i] == dev) grid.held &= ~(1U << i);
+    if (grid.active && grid.dev == dev) grid_stop();
+}
+
+void handle_input_event(input_device_t* dev, struct input_event* ev)
+{
+    flight.current = flight_add(FLIGHT_IN, flight_time(dev, ev), ev->type, ev->code, ev->value, flight_device(dev));
+    if (ev->type == EV_KEY) {
+        log_debug("Got keycode 0x%x (%d)", ev->code, ev->code);
+        if (dev && ev->code < KEY_CNT && ev->value && bit_test(dev->shadowed, ev->code)) {
+            // Handled as the scancode from the lirc device, releases still go through
+            flight_note(FLIGHT_SWALLOWED);
+        } else if ((grid.active || grid.held) && grid_key(dev, ev)) {
+            flight_note(ACTION_GRID);
+        } else if (config->sequence_node_count > config->layer_count && ev->code < CODE_CNT) {
+            // Every layer has a root node, more nodes mean there are sequences
+            sequence_feed(dev, ev);
+        } else {
+            dispatch_key(dev, ev);
+        }
+    } else {
+        forward_event(dev, uinput_fd, ev);
+        // Passthrough events reach uinput when their frame's SYN_REPORT does
+        if (ev->type == EV_SYN && ev->code == SYN_REPORT) record_latency(LATENCY_PASSTHROUGH, dev, ev);
+    }
+    flight.current = NULL;
+}
+
+// Time dispatch lookups against table size, run with --bench-dispatch
+void bench_dispatch(void)
+{
+    const int sizes[] = {1, 16, 64, 128, MAX_MAPPINGS};
+    const int lookups = 20000000;
+    unsigned int seed = 1;
+    volatile long hits = 0;
+    config_t* saved = config;
+    static config_t bench;
+
+    config = &bench;
+    active_layer = &bench.layers[0];
+
+    printf("%8s %14s %14s\n", "mappings", "table ns/ev", "scan ns/ev");
+    for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        init_config(&bench);
+        bench.mapping_count = sizes[s];
+        for (int i = 0; i < bench.mapping_count; i++)
+            bench.mappings[i].code = KEY_CNT - 1 - i;
+        build_dispatch(&bench);
+
+        // Mostly unmapped keys, the common passthrough case
+        uint64_t start = now_ns();
+        for (int i = 0; i < lookups; i++) {
+            seed = seed * 1103515245 + 12345;
+            if (lookup_mapping((seed >> 8) % KEY_CNT)) hits++;
+        }
+        uint64_t table = now_ns() - start;
+
+        start = now_ns();
+        for (int i = 0; i < lookups; i++) {
+            seed = seed * 1103515245 + 12345;
+            unsigned int code = (seed >> 8) % KEY_CNT;
+            for (int j = 0; j < bench.mapping_count; j++) {
+                if (bench.mappings[j].code == code) { hits++; break; }
+            }
+        }
+        uint64_t scan = now_ns() - start;
+
+        printf("%8d %14.2f %14.2f\n", bench.mapping_count,
+               (double)table / lookups, (double)scan / lookups);
+    }
+    config = saved;
+    active_layer = config ? &config->layers[0] : NULL;
+}
+
+void detach_device(input_device_t* dev);
+
+/*
+ * Merge relative motion in a batch of events in place and return the new
+ * count. REL_X and REL_Y repeated within a frame are summed, and a run of
+ * frames holding nothing but REL_X and REL_Y becomes one frame, so a backlog
+ * from a flooding pointer device goes out as a single movement.
+ */
+int coalesce_motion(struct input_event* ev, int n)
+{
+    int out = 0, motion_only = 1;
+    int x = -1, y = -1;     // index in ev[] of the current frame's REL_X and REL_Y
+
+    for (int i = 0; i < n; i++) {
+        struct input_event* e = &ev[i];
+        if (e->type == EV_REL && (e->code == REL_X || e->code == REL_Y)) {
+            int* slot = e->code == REL_X ? &x : &y;
+            if (*slot >= 0) {
+                ev[*slot].value += e->value;
+                input_stats.merged_events++;
+            } else {
+                *slot = out;
+                ev[out++] = *e;
+            }
+        } else if (e->type == EV_SYN && e->code == SYN_REPORT) {
+            // Only a whole frame that just moves too is added in, motion never
+            // crosses into a frame with a key or button in it
+            int len = frame_length(ev + i + 1, n - i - 1), dx, dy;
+            if (motion_only && len && frame_motion(ev + i + 1, len, &dx, &dy)) {
+                input_stats.merged_events++;
+                input_stats.merged_frames++;
+                continue;
+            }
+            ev[out++] = *e;
+            x = y = -1;
+            motion_only = 1;
+        } else {
+            motion_only = 0;
+            ev[out++] = *e;
+        }
+    }
+    return out;
+}
+
+// After an overflow, release the keys the device let go of while its events were lost
+void resync_keys(input_device_t* dev)
+{
+    unsigned long state[KEY_CNT / BITS_PER_LONG + 1];
+    memset(state, 0, sizeof(state));
+    if (dev->src.fd >= 0) ioctl(dev->src.fd, EVIOCGKEY(sizeof(state)), state);
+    for (int code = 0; code < KEY_CNT; code++) {
+        if (bit_test(dev->keys_down, code) && !bit_test(state, code)) {
+            emit(uinput_fd, EV_KEY, code, 0);
+            dev->keys_down[code / BITS_PER_LONG] &= ~(1UL << (code % BITS_PER_LONG));
+        }
+    }
+    flush_frame(uinput_fd);
+}
+
+// Handle a batch from one device, frame by frame
+void handle_input_batch(input_device_t* dev, struct input_event* ev, int n)
+{
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        if (ev[i].type == EV_SYN && ev[i].code == SYN_DROPPED) {
+            input_stats.overflows++;
+            dev->dropping = 1;
+        } else if (dev->dropping) {
+            flight_record_t* record = flight_add(FLIGHT_IN, flight_time(dev, &ev[i]), ev[i].type, ev[i].code, ev[i].value, flight_device(dev));
+            if (record) record->action = FLIGHT_DROPPED;
+            input_stats.dropped_events++;
+            if (ev[i].type == EV_SYN && ev[i].code == SYN_REPORT) {
+                dev->dropping = 0;
+                resync_keys(dev);
+            }
+        } else {
+            ev[kept++] = ev[i];
+        }
+    }
+
+    n = coalesce_motion(ev, kept);
+    for (int i = 0; i < n; i++)
+        handle_input_event(dev, &ev[i]);
+}
+
+void input_ready(event_source_t* src, uint32_t events)
+{
+    input_device_t* dev = (input_device_t*)src;
+    struct input_event batch[READ_BATCH];
+
+    // One read per wakeup keeps devices fair, epoll reports the rest again
+    if (src->fd < 0) return;
+    ssize_t len = read(src->fd, batch, sizeof(batch));
+    if (len < 0) {
+        if (errno == EAGAIN || errno == EINTR) return;
+        // ENODEV when the device was unplugged
+        detach_device(dev);
+        return;
+    }
+    int n = len / sizeof(struct input_event);
+    input_stats.reads++;
+    input_stats.events += n;
+    if (record_file) {
+        for (int i = 0; i < n; i++)
+            write_capture_line(record_file, &batch[i]);
+    }
+    handle_input_batch(dev, batch, n);
+}
+
+/*
+ * Raw scancodes from a /dev/lirc device in LIRC_MODE_SCANCODE, for remotes
+ * the kernel keymap does not cover. A mapped scancode is pressed as its key
+ * code above KEY_CNT and goes through layers, sequences and mappings like any
+ * key. The receiver only reports the remote sending the code again while a
+ * button is held, so the key is released when that stops.
+ */
+struct {
+    input_device_t dev;         // src.fd is the lirc fd
+    timer_source_t release;     // armed while a scancode key is held
+    int code;                   // key code held, -1 for none
+    uint64_t scancode;
+    unsigned int proto;
+    unsigned int toggle;        // LIRC_SCANCODE_FLAG_TOGGLE of the press being held
+} lirc = {.dev = {.src = {.fd = -1, .handle = lirc_ready}, .clock = CLOCK_MONOTONIC}, .code = -1};
+int lirc_cli;                   // opened from the command line, lircDevice does not apply
+
+// How often a remote repeats a held button, the protocol timings of the kernel's rc-core
+int lirc_repeat_ms(unsigned int proto)
+{
+    switch (proto) {
+        case RC_PROTO_NEC: case RC_PROTO_NECX: case RC_PROTO_NEC32:
+            return 110;
+        case RC_PROTO_RC5: case RC_PROTO_RC5X_20: case RC_PROTO_RC5_SZ:
+        case RC_PROTO_RC6_0: case RC_PROTO_RC6_6A_20: case RC_PROTO_RC6_6A_24:
+        case RC_PROTO_RC6_6A_32: case RC_PROTO_RC6_MCE: case RC_PROTO_IMON:
+        case RC_PROTO_RCMM12: case RC_PROTO_RCMM24: case RC_PROTO_RCMM32:
+            return 114;
+        case RC_PROTO_SONY12: case RC_PROTO_SONY15: case RC_PROTO_SONY20:
+        case RC_PROTO_MCIR2_KBD: case RC_PROTO_MCIR2_MSE:
+            return 100;
+        case RC_PROTO_XBOX_DVD:
+            return 64;
+        default:
+            return 125;
+    }
+}
+
+// Missing one repeat is not a release, missing the next one is
+uint64_t lirc_release_ns(unsigned int proto)
+{
+    if (config->scancode_release_ms) return config->scancode_release_ms * 1000000ULL;
+    return lirc_repeat_ms(proto) * 1500000ULL;
+}
+
+// At most MAX_SCANCODES to compare, and a remote sends a few records a second
+int scancode_code(uint64_t scancode)
+{
+    for (int i = 0; i < config->scancode_count; i++)
+        if (config->scancodes[i] == scancode) return KEY_CNT + i;
+    return -1;
+}
+
+void lirc_key(uint64_t stamp, int value)
+{
+    struct input_event ev = {.type = EV_KEY, .code = lirc.code, .value = value};
+    ev.time.tv_sec = stamp / 1000000000ULL;
+    ev.time.tv_usec = stamp % 1000000000ULL / 1000;
+    handle_input_event(&lirc.dev, &ev);
+    flush_frame(uinput_fd);
+}
+
+void lirc_release(void)
+{
+    if (lirc.code < 0) return;
+    timer_disarm(&lirc.release);
+    lirc_key(now_ns(), 0);
+    lirc.code = -1;
+}
+
+void lirc_release_tick(timer_source_t* timer)
+{
+    lirc_release();
+}
+
+void lirc_feed(const struct lirc_scancode* sc)
+{
+    unsigned int toggle = sc->flags & LIRC_SCANCODE_FLAG_TOGGLE;
+    flight_record_t* record = flight_add(FLIGHT_IN, sc->timestamp, EV_LIRC, sc->rc_proto, (int32_t)sc->scancode, FLIGHT_LIRC);
+    if (record) record->flags = sc->flags;
+
+    // The button is still held when the code comes again, a flipped toggle bit means it was pressed anew
+    if (lirc.code >= 0 && sc->scancode == lirc.scancode && sc->rc_proto == lirc.proto &&
+        ((sc->flags & LIRC_SCANCODE_FLAG_REPEAT) || toggle == lirc.toggle)) {
+        timer_arm(&lirc.release, lirc_release_ns(sc->rc_proto), 0);
+        lirc_key(sc->timestamp, 2);
+        return;
+    }
+
+    lirc_release();
+    int code = scancode_code(sc->scancode);
+    if (code < 0) {
+        log_debug("Unmapped scancode 0x%llx protocol %u", (unsigned long long)sc->scancode, sc->rc_proto);
+        if (record) record->action = FLIGHT_IGNORED;
+        return;
+    }
+    lirc.code = code;
+    lirc.scancode = sc->scancode;
+    lirc.proto = sc->rc_proto;
+    lirc.toggle = toggle;
+    timer_arm(&lirc.release, lirc_release_ns(sc->rc_proto), 0);
+    lirc_key(sc->timestamp, 1);
+}
+
+void lirc_shadow_all(void);
+
+void lirc_close(void)
+{
+    if (lirc.dev.src.fd < 0) return;
+    log_info("Releasing lirc device %s", lirc.dev.path);
+    lirc_release();
+    epoll_ctl(epfd, EPOLL_CTL_DEL, lirc.dev.src.fd, NULL);
+    close(lirc.dev.src.fd);
+    lirc.dev.src.fd = -1;
+    lirc_shadow_all();
+    sequence_forget(&lirc.dev);
+    hold_forget(&lirc.dev);
+    if (combo_repeat.code >= 0 && combo_repeat.dev == &lirc.dev) combo_repeat_stop();
+}
+
+void lirc_ready(event_source_t* src, uint32_t events)
+{
+    struct lirc_scancode batch[LIRC_BATCH];
+
+    ssize_t len = read(src->fd, batch, sizeof(batch));
+    if (len < 0) {
+        if (errno == EAGAIN || errno == EINTR) return;
+        // ENODEV when the receiver was unplugged
+        lirc_close();
+        return;
+    }
+    int n = len / sizeof(batch[0]);
+    input_stats.reads++;
+    input_stats.events += n;
+    for (int i = 0; i < n; i++) {
+        if (record_file) write_scancode_line(record_file, &batch[i]);
+        lirc_feed(&batch[i]);
+    }
+}
+
+int lirc_open(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        log_warn("Could not open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    unsigned int mode = LIRC_MODE_SCANCODE;
+    if (ioctl(fd, LIRC_SET_REC_MODE, &mode) < 0) {
+        log_warn("%s does not report scancodes: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    lirc_close();
+    strncpy(lirc.dev.path, path, sizeof(lirc.dev.path) - 1);
+    lirc.dev.src.fd = fd;
+    lirc.dev.src.handle = lirc_ready;
+    epoll_add(&lirc.dev.src);
+    log_info("Opening lirc device %s", path);
+    lirc_shadow_all();
+    return 0;
+}
+
+// Real sysfs path of what is up from the character device fd, e.g. "device" for its parent
+int sysfs_parent(int fd, const char* up, char* buf)
+{
+    struct stat st;
+    char link[PATH_MAX];
+    if (fstat(fd, &st) < 0 || !S_ISCHR(st.st_mode)) return -1;
+    snprintf(link, sizeof(link), "/sys/dev/char/%u:%u/%s", major(st.st_rdev), minor(st.st_rdev), up);
+    return realpath(link, buf) ? 0 : -1;
+}
+
+/*
+ * An rc-core receiver sends every button twice, as a scancode on its lirc
+ * device and as the key its keymap gives on its own input device. The keys
+ * the keymap gives mapped scancodes are dropped from that input device, so
+ * one button fires one action. Other devices, and other receivers, are left
+ * alone.
+ */
+void lirc_shadow(input_device_t* dev)
+{
+    char rc[PATH_MAX], parent[PATH_MAX];
+    memset(dev->shadowed, 0, sizeof(dev->shadowed));
+    // The lirc device hangs off the rc device, the input device off an input node under it
+    if (lirc.dev.src.fd < 0 || sysfs_parent(lirc.dev.src.fd, "device", rc) < 0
+            || sysfs_parent(dev->src.fd, "device/device", parent) < 0 || strcmp(rc, parent))
+        return;
+
+    for (int s = 0; s < config->scancode_count; s++) {
+        struct input_keymap_entry entry = {.len = sizeof(uint32_t)};
+        uint32_t scancode = config->scancodes[s];
+        if (config->scancodes[s] > UINT32_MAX) continue;
+        memcpy(entry.scancode, &scancode, sizeof(scancode));
+        if (ioctl(dev->src.fd, EVIOCGKEYCODE_V2, &entry) < 0 || entry.keycode == KEY_RESERVED || entry.keycode >= KEY_CNT)
+            continue;
+        bit_set(dev->shadowed, entry.keycode);
+        for (int l = 0; l < config->layer_count; l++) {
+            const layer_t* layer = &config->layers[l];
+            if (layer->dispatch[KEY_CNT + s] >= 0 && layer->dispatch[entry.keycode] >= 0)
+                log_warn("Layer %s maps scancode 0x%x and %s, which the receiver's keymap turns it into,"
+                         " %s only gets the scancode mapping", layer->name, scancode,
+                         key_code_name(entry.keycode) ? key_code_name(entry.keycode) : "its key", dev->path);
+        }
+    }
+}
+
+void lirc_shadow_all(void)
+{
+    for (int i = 0; i < MAX_DEVICES; i++)
+        if (devices[i].src.fd >= 0) lirc_shadow(&devices[i]);
+}
+
+/*
+ * Push a synthetic pointer flood through a pipe and read it back like an
+ * input device, one event per read() as before and in batches with and
+ * without merging motion. Run with --bench-flood.
+ */
+void bench_flood(void)
+{
+    const struct { int batch; int coalesce; } modes[] = {{1, 0}, {8, 1}, {READ_BATCH, 0}, {READ_BATCH, 1}};
+    const int chunk = 2048;             // events written at once, fits in a pipe
+    const int total = 2000000;
+    static config_t defaults;
+    static input_device_t flood_device = {.src.fd = -1, .clock = CLOCK_MONOTONIC, .path = "flood"};
+    struct input_event* events = malloc(chunk * sizeof(struct input_event));
+    int fds[2];
+
+    if (!events) die("error: malloc");
+    if (pipe2(fds, O_CLOEXEC) < 0) die("error: pipe2");
+    init_config(&defaults);
+    config = &defaults;
+    active_layer = &defaults.layers[0];
+    output_kind = OUTPUT_MEMORY;
+
+    // An air mouse: REL_X, REL_Y and SYN_REPORT, with a click now and then
+    for (int i = 0; i + 3 <= chunk; i += 3) {
+        int click = i % 300 == 0;
+        events[i].type = click ? EV_KEY : EV_REL;
+        events[i].code = click ? BTN_LEFT : REL_X;
+        events[i].value = click ? (i / 300) % 2 == 0 : 1;
+        events[i + 1].type = EV_REL;
+        events[i + 1].code = REL_Y;
+        events[i + 1].value = -1;
+        events[i + 2].type = EV_SYN;
+        events[i + 2].code = SYN_REPORT;
+        events[i + 2].value = 0;
+    }
+    int per_chunk = chunk / 3 * 3;
+
+    printf("%6s %9s %12s %13s %10s\n", "batch", "coalesce", "events/s", "read ns/ev", "out/in");
+    for (unsigned int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        struct input_event batch[READ_BATCH];
+        uint64_t read_ns = 0, output_before = output_count;
+        int done = 0;
+
+        uint64_t start = clock_ns();
+        while (done < total) {
+            if (write(fds[1], events, per_chunk * sizeof(struct input_event)) < 0) die("error: write");
+            for (int left = per_chunk; left > 0; ) {
+                int want = left < modes[m].batch ? left : modes[m].batch;
+                uint64_t before = clock_ns();
+                ssize_t len = read(fds[0], batch, want * sizeof(struct input_event));
+                read_ns += clock_ns() - before;
+                if (len <= 0) die("error: read");
+                int n = len / sizeof(struct input_event);
+                left -= n;
+                if (modes[m].coalesce) {
+                    handle_input_batch(&flood_device, batch, n);
+                } else {
+                    for (int i = 0; i < n; i++)
+                        handle_input_event(&flood_device, &batch[i]);
+                }
+            }
+            done += per_chunk;
+        }
+        uint64_t wall = clock_ns() - start;
+        printf("%6d %9s %12.0f %13.1f %10.3f\n", modes[m].batch, modes[m].coalesce ? "yes" : "no",
+               done / (wall / 1e9), (double)read_ns / done, (double)(output_count - output_before) / done);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    free(events);
+}
+
+/*
+ * Write pointer movement with a click now and then to a virtual device that
+ * takes less than it is given, a datagram socket read every third frame
+ * standing in for uinput, and check what arrives. Run with --bench-output.
+ */
+struct {
+    uint64_t moved, presses, releases, reports;
+} bench_arrived;
+
+// Read one datagram like the slow reader would, 0 when there was none
+int bench_output_read(int fd)
+{
+    struct input_event batch[OUTPUT_QUEUE_SIZE];
+    ssize_t len = read(fd, batch, sizeof(batch));
+    for (int e = 0; e < len / (ssize_t)sizeof(struct input_event); e++) {
+        if (batch[e].type == EV_REL && batch[e].code == REL_X) bench_arrived.moved += batch[e].value;
+        if (batch[e].type == EV_KEY && batch[e].value) bench_arrived.presses++;
+        if (batch[e].type == EV_KEY && !batch[e].value) bench_arrived.releases++;
+        if (batch[e].type == EV_SYN) bench_arrived.reports++;
+    }
+    return len > 0;
+}
+
+void bench_output_poll(void)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, 0);
+    for (int i = 0; i < n; i++) {
+        event_source_t* src = events[i].data.ptr;
+        src->handle(src, events[i].events);
+    }
+}
+
+void bench_output(void)
+{
+    const int frames = 200000;
+    static config_t defaults;
+    int fds[2], size = 1 << 20;
+    uint64_t moved = 0, clicks = 0;
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) die("error: socketpair");
+    // Room for the whole queue in one datagram, the reader's queue length is what pushes back
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    init_config(&defaults);
+    config = &defaults;
+    active_layer = &defaults.layers[0];
+    output_kind = OUTPUT_UINPUT;
+    uinput_fd = fds[0];
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) die("error: epoll_create1");
+
+    uint64_t start = clock_ns();
+    for (int i = 0; i < frames; i++) {
+        if (i % 50 == 0) {
+            emit(uinput_fd, EV_KEY, BTN_LEFT, 1);
+            flush_frame(uinput_fd);
+            emit(uinput_fd, EV_KEY, BTN_LEFT, 0);
+            flush_frame(uinput_fd);
+            clicks++;
+        } else {
+            move_mouse(uinput_fd, 1, 0);
+            moved++;
+        }
+        if (i % 3 == 0) bench_output_read(fds[1]);
+        bench_output_poll();
+    }
+    // Catch up with everything still queued
+    while (bench_output_read(fds[1]) || output_queue.end > output_queue.start)
+        bench_output_poll();
+    uint64_t wall = clock_ns() - start;
+
+    printf("%d frames in %.1f ms, %llu clicks sent, %llu pressed and %llu released, %llu SYN_REPORTs\n",
+           frames, wall / 1e6, (unsigned long long)clicks, (unsigned long long)bench_arrived.presses,
+           (unsigned long long)bench_arrived.releases, (unsigned long long)bench_arrived.reports);
+    printf("Moved %llu pixels, %llu arrived\n", (unsigned long long)moved, (unsigned long long)bench_arrived.moved);
+    printf("Queued %llu events (at most %d), merged %llu movements, dropped %llu, queue full %llu times, %llu events lost\n",
+           (unsigned long long)output_stats.queued_events, output_stats.max_queued,
+           (unsigned long long)output_stats.merged_frames, (unsigned long long)output_stats.dropped_frames,
+           (unsigned long long)output_stats.full, (unsigned long long)output_stats.lost_events);
+    close(fds[0]);
+    close(fds[1]);
+    uinput_fd = -1;
+}
+
+/*
+ * Play overlapping macros live from the timer into a socket standing in for
+ * the virtual device and report how late their steps went out. Run with
+ * --bench-macro.
+ */
+void bench_macro(void)
+{
+    const int delays_ms[] = {5, 7, 11, 13};
+    const int count = sizeof(delays_ms) / sizeof(delays_ms[0]), taps = 100;
+    static config_t bench;
+    static action_t actions[4];
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int fds[2];
+
+    // Each macro taps a key, its own, every delays_ms[i]
+    init_config(&bench);
+    for (int i = 0; i < count; i++) {
+        actions[i].type = ACTION_MACRO;
+        actions[i].data.macro.first = bench.macro_step_count;
+        actions[i].data.macro.count = 2 * taps;
+        for (int t = 0; t < 2 * taps; t++) {
+            macro_step_t* step = &bench.macro_steps[bench.macro_step_count++];
+            step->type = EV_KEY;
+            step->code = KEY_A + i;
+            step->value = !(t & 1);
+            step->delay_ms = t ? delays_ms[i] : 0;
+        }
+    }
+    config = &bench;
+    active_layer = &bench.layers[0];
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) die("error: socketpair");
+    output_kind = OUTPUT_UINPUT;
+    uinput_fd = fds[0];
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) die("error: epoll_create1");
+    timer_init(&macros.timer, macro_tick);
+
+    uint64_t start = clock_ns();
+    for (int i = 0; i < count; i++)
+        macro_start(&actions[i]);
+    for (;;) {
+        int playing = 0;
+        for (int i = 0; i < MAX_RUNNING_MACROS; i++)
+            if (macros.players[i].step) playing++;
+        if (!playing) break;
+        int n = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            event_source_t* src = events[i].data.ptr;
+            src->handle(src, events[i].events);
+        }
+        while (bench_output_read(fds[1]));
+    }
+    uint64_t wall = clock_ns() - start;
+
+    histogram_t* h = &macros.lateness;
+    printf("%d macros of %d steps at once, every 5, 7, 11 and 13 ms, played in %.1f ms\n",
+           count, 2 * taps, wall / 1e6);
+    printf("%llu steps late by p50 %.1f us p99 %.1f us max %.1f us, %llu pressed and %llu released\n",
+           (unsigned long long)h->count, histogram_percentile(h, 50) / 1e3, histogram_percentile(h, 99) / 1e3,
+           h->max / 1e3, (unsigned long long)bench_arrived.presses, (unsigned long long)bench_arrived.releases);
+    close(fds[0]);
+    close(fds[1]);
+    uinput_fd = -1;
+}
+
+input_device_t* find_device(const char* path)
+{
+    for (int i = 0; i < MAX_DEVICES; i++)
+        if (devices[i].src.fd >= 0 && !strcmp(devices[i].path, path)) return &devices[i];
+    return NULL;
+}
+
+/*
+ * A device plugged in later or a reloaded config needs codes the virtual
+ * device does not announce. A uinput device can not change once created and
+ * creating it again would release everything held on the desktop, so it stays
+ * as it is and the kernel drops those codes until the daemon is restarted.
+ * Returns how many codes are missing, status and the reload reply say so.
+ */
+int uinput_check(const caps_t* need, const char* what)
+{
+    int missing = uinput_fd >= 0 ? caps_missing(&announced, need) : 0;
+    if (!missing) return 0;
+
+    for (unsigned int i = 0; i < sizeof(caps_t) / sizeof(long); i++)
+        ((unsigned long*)&unannounced)[i] |= ((const unsigned long*)need)[i] & ~((const unsigned long*)&announced)[i];
+    log_warn("%s can send %d codes the virtual device does not announce, restart the daemon to send them",
+             what, missing);
+    return missing;
+}
+
+int attach_device(const char* path)
+{
+    if (find_device(path)) return 0;
+
+    input_device_t* dev = NULL;
+    for (int i = 0; i < MAX_DEVICES && !dev; i++)
+        if (devices[i].src.fd < 0) dev = &devices[i];
+    if (!dev) {
+        log_warn("Too many input devices, ignoring %s", path);
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        log_warn("Could not open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (ioctl(fd, EVIOCGRAB, 1) < 0) {
+        log_warn("Could not grab %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    memset(dev, 0, sizeof(*dev));
+    strncpy(dev->path, path, sizeof(dev->path) - 1);
+
+    // Monotonic timestamps so latency can be measured against now_ns()
+    int clock = CLOCK_MONOTONIC;
+    dev->clock = ioctl(fd, EVIOCSCLOCKID, &clock) < 0 ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+    dev->src.fd = fd;
+    dev->src.handle = input_ready;
+    epoll_add(&dev->src);
+    log_info("Opening input device %s", path);
+
+    caps_t caps;
+    memset(&caps, 0, sizeof(caps));
+    device_caps(fd, &caps);
+    uinput_check(&caps, path);
+    lirc_shadow(dev);
+    return 0;
+}
+
+void detach_device(input_device_t* dev)
+{
+    log_info("Releasing input device %s", dev->path);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, dev->src.fd, NULL);
+    close(dev->src.fd);
+    dev->src.fd = -1;
+
+    // Nothing will release what the device was holding, do it here
+    for (int code = 0; code < KEY_CNT; code++) {
+        if (dev->keys_down[code / BITS_PER_LONG] & (1UL << (code % BITS_PER_LONG)))
+            emit(uinput_fd, EV_KEY, code, 0);
+    }
+    flush_frame(uinput_fd);
+    for (int i = motion.count - 1; i >= 0; i--)
+        if (motion.keys[i].dev == dev) motion_release(motion.keys[i].code);
+    sequence_forget(dev);
+    hold_forget(dev);
+    if (combo_repeat.code >= 0 && combo_repeat.dev == dev) combo_repeat_stop();
+}
+
+int match_device(const char* name)
+{
+    for (int i = 0; i < config->device_pattern_count; i++)
+        if (fnmatch(config->device_patterns[i], name, 0) == 0) return 1;
+    for (int i = 0; i < cli_pattern_count; i++)
+        if (fnmatch(cli_patterns[i], name, 0) == 0) return 1;
+    return 0;
+}
+
+void scan_devices(void)
+{
+    char path[PATH_MAX];
+    struct dirent *ep;
+    DIR *dp = opendir(INPUT_DIR);
+    if (dp == NULL) return;
+    while ((ep = readdir(dp))) {
+        if (ep->d_name[0] == '.' || !match_device(ep->d_name)) continue;
+        snprintf(path, sizeof(path), "%s%s", INPUT_DIR, ep->d_name);
+        attach_device(path);
+    }
+    closedir(dp);
+}
+
+void watch_input_dir(void)
+{
+    hotplug.dir_wd = inotify_add_watch(hotplug.src.fd, INPUT_DIR, IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM);
+    if (hotplug.dir_wd >= 0) {
+        if (hotplug.root_wd >= 0) inotify_rm_watch(hotplug.src.fd, hotplug.root_wd);
+        hotplug.root_wd = -1;
+        scan_devices();
+    } else if (hotplug.root_wd < 0) {
+        // No devices at all yet, wait for udev to create the by-path directory
+        hotplug.root_wd = inotify_add_watch(hotplug.src.fd, INPUT_ROOT, IN_CREATE);
+        if (hotplug.root_wd < 0) log_warn("Cannot watch %s, hotplug disabled", INPUT_ROOT);
+    }
+}
+
+// Swap in a freshly parsed config, the running one stays when the new one is bad.
+// Returns -1 then, else the number of codes the new mappings send that the virtual device does not announce
+int reload_config(void)
+{
+    uint64_t start = now_ns();
+    config_t* next = open_config(config_path, cache_path);
+    if (!next) {
+        log_error("Reload failed, keeping the current mappings");
+        return -1;
+    }
+
+    caps_t caps;
+    memset(&caps, 0, sizeof(caps));
+    config_caps(next, &caps);
+    int missing = uinput_check(&caps, "The new config");
+
+    // Keys held back for a sequence go through the old config, as if the sequence broke off here
+    while (sequence.count) sequence_resolve();
+    flush_frame(uinput_fd);
+
+    // Scancode key codes are numbered per config, let go of the held one while it still means the same
+    lirc_release();
+
+    // Stay in the same layer when the new config still has it
+    config_t* prev = config;
+    int layer = find_layer(next, active_layer->name);
+    config = next;
+    active_layer = &next->layers[layer < 0 ? 0 : layer];
+    layer_return.toggled_from = 0;
+    layer_return.hold_code = -1;
+    motion_rebind();
+    sequence_reset();   // trie nodes of the old config, nothing is held back any more
+    combo_repeat_stop();
+    grid_stop();
+    macro_stop_all();
+    if (pointer_fd < 0 && uinput_fd >= 0 && config_has_grid(next)) create_pointer();
+    if (motion.count && next->motion_rate_hz != prev->motion_rate_hz)
+        timer_arm(&motion.timer, 1000000000ULL / next->motion_rate_hz, 1000000000ULL / next->motion_rate_hz);
+    if (next->stats_interval != prev->stats_interval)
+        timer_arm(&stats_timer, next->stats_interval * 1000000000ULL, next->stats_interval * 1000000000ULL);
+    exec_rebind(prev, next);
+    if (next->realtime_priority != prev->realtime_priority || next->cpu_affinity != prev->cpu_affinity)
+        apply_realtime(next);
+    if (!lirc_cli && (strcmp(next->lirc_device, prev->lirc_device) || (lirc.dev.src.fd < 0 && next->lirc_device[0]))) {
+        lirc_close();
+        if (next->lirc_device[0]) lirc_open(next->lirc_device);
+    }
+    // Scancodes are numbered per config, and the warnings belong to the new one
+    lirc_shadow_all();
+    free_config(prev);
+
+    // New inputDevices patterns may match devices that are already plugged in
+    scan_devices();
+    log_info("Reloaded %s in %.2f ms", config_path, (now_ns() - start) / 1e6);
+    return missing;
+}
+
+void signal_ready(event_source_t* src, uint32_t events)
+{
+    struct signalfd_siginfo si;
+    if (read(src->fd, &si, sizeof(si)) != sizeof(si)) return;
+    if (si.ssi_signo == SIGHUP) reload_config();
+    if (si.ssi_signo == SIGCHLD) reap_children();
+    if (si.ssi_signo == SIGUSR1) dump_stats();
+    if (si.ssi_signo == SIGUSR2) {
+        log_level = log_level == LEVEL_DEBUG ? base_log_level : LEVEL_DEBUG;
+        log_write(LEVEL_INFO, "Log level %s", level_names[log_level]);
+    }
+}
+
+/*
+ * Control socket: a datagram socket at control_path, each datagram is one
+ * command and gets one datagram back, so there is no connection state and a
+ * slow client can not hold up the event loop. The start/stop/status client
+ * commands and the inspection commands below use it.
+ */
+const char* control_path = CONTROL_PATH;
+event_source_t control = {.fd = -1};
+uint64_t daemon_started;
+
+const char* action_names[] = {"move_mouse", "key_combination", "execute", "switch_layer",
+                              "toggle_layer", "hold_layer", "passthrough", "grid", "macro"};
+
+// Key name, the scancode behind a code above KEY_CNT, or the number
+const char* code_label(int code, char* buf, size_t size)
+{
+    const char* name = key_code_name(code);
+    if (name) return name;
+    if (code >= KEY_CNT) snprintf(buf, size, "scancode 0x%llx", (unsigned long long)config->scancodes[code - KEY_CNT]);
+    else snprintf(buf, size, "0x%x", code);
+    return buf;
+}
+
+void reply_key(reply_t* reply, int code)
+{
+    char buf[32];
+    reply_printf(reply, "%s", code_label(code, buf, sizeof(buf)));
+}
+
+void reply_action(reply_t* reply, const action_t* action)
+{
+    reply_printf(reply, "%s", action_names[action->type]);
+    switch (action->type) {
+        case ACTION_MOVE_MOUSE:
+            reply_printf(reply, " x %d y %d profile %d", action->data.mouse.x, action->data.mouse.y,
+                         action->data.mouse.profile);
+            break;
+        case ACTION_KEY_COMBO:
+            for (int i = 0; i < action->data.combo.count; i++) {
+                reply_printf(reply, i ? "+" : " ");
+                reply_key(reply, action->data.combo.keys[i]);
+            }
+            if (action->data.combo.repeat_rate_ms)
+                reply_printf(reply, " repeat %d/%d ms", action->data.combo.repeat_delay_ms, action->data.combo.repeat_rate_ms);
+            break;
+        case ACTION_EXECUTE:
+            reply_printf(reply, " %s", action->data.exec.command);
+            if (action->data.exec.running || action->data.exec.queued)
+                reply_printf(reply, " (%d running, %d queued)", action->data.exec.running, action->data.exec.queued);
+            break;
+        case ACTION_SWITCH_LAYER:
+        case ACTION_TOGGLE_LAYER:
+        case ACTION_HOLD_LAYER:
+            reply_printf(reply, " %s", config->layers[action->data.layer.index].name);
+            break;
+        case ACTION_GRID:
+            for (int i = 0; i <= GRID_CELLS; i++) {
+                reply_printf(reply, " ");
+                reply_key(reply, action->data.grid.keys[i]);
+            }
+            break;
+        case ACTION_MACRO:
+            reply_printf(reply, " %d steps", action->data.macro.count);
+            break;
+        case ACTION_PASSTHROUGH:
+            break;
+    }
+}
+
+// The compiled dispatch tables, per layer the keys it maps itself and the ones it inherits
+void reply_mappings(reply_t* reply)
+{
+    for (int l = 0; l < config->layer_count; l++) {
+        const layer_t* layer = &config->layers[l];
+        reply_printf(reply, "%s%s:\n", layer->name, layer == active_layer ? " (active)" : "");
+        for (int code = 0; code < CODE_CNT; code++) {
+            if (layer->dispatch[code] < 0) continue;
+            const key_mapping_t* mapping = &config->mappings[layer->dispatch[code]];
+            char buf[32];
+            reply_printf(reply, "  %-24s ", code_label(code, buf, sizeof(buf)));
+            reply_action(reply, &mapping->action);
+            reply_printf(reply, "%s\n", mapping->layer != l ? " (inherited)" : "");
+        }
+        for (int i = 0; i < config->mapping_count; i++) {
+            const key_mapping_t* mapping = &config->mappings[i];
+            if (mapping->code >= 0 || mapping->layer != l) continue;
+            reply_printf(reply, " ");
+            for (int k = 0; k < mapping->sequence_length; k++) {
+                reply_printf(reply, " ");
+                reply_key(reply, mapping->sequence[k]);
+            }
+            reply_printf(reply, "  ");
+            reply_action(reply, &mapping->action);
+            reply_printf(reply, "\n");
+        }
+    }
+}
+
+// Raw numbers, one "name value" per line for scripts
+void reply_counters(reply_t* reply)
+{
+    int running = 0, queued = 0;
+    for (int i = 0; i < config->mapping_count; i++) {
+        if (config->mappings[i].action.type != ACTION_EXECUTE) continue;
+        running += config->mappings[i].action.data.exec.running;
+        queued += config->mappings[i].action.data.exec.queued;
+    }
+    reply_printf(reply, "input_reads %llu\n", (unsigned long long)input_stats.reads);
+    reply_printf(reply, "input_events %llu\n", (unsigned long long)input_stats.events);
+    reply_printf(reply, "input_merged_events %llu\n", (unsigned long long)input_stats.merged_events);
+    reply_printf(reply, "input_merged_frames %llu\n", (unsigned long long)input_stats.merged_frames);
+    reply_printf(reply, "input_overflows %llu\n", (unsigned long long)input_stats.overflows);
+    reply_printf(reply, "input_dropped_events %llu\n", (unsigned long long)input_stats.dropped_events);
+    reply_printf(reply, "output_queued_events %llu\n", (unsigned long long)output_stats.queued_events);
+    reply_printf(reply, "output_queued_now %d\n",
+                 output_queue.end - output_queue.start + pointer_queue.end - pointer_queue.start);
+    reply_printf(reply, "output_queued_max %d\n", output_stats.max_queued);
+    reply_printf(reply, "output_merged_frames %llu\n", (unsigned long long)output_stats.merged_frames);
+    reply_printf(reply, "output_dropped_frames %llu\n", (unsigned long long)output_stats.dropped_frames);
+    reply_printf(reply, "output_dropped_events %llu\n", (unsigned long long)output_stats.dropped_events);
+    reply_printf(reply, "output_full %llu\n", (unsigned long long)output_stats.full);
+    reply_printf(reply, "output_lost_events %llu\n", (unsigned long long)output_stats.lost_events);
+    reply_printf(reply, "output_errors %llu\n", (unsigned long long)output_stats.errors);
+    for (int kind = 0; kind < LATENCY_KINDS; kind++)
+        reply_printf(reply, "latency_%s_events %llu\n", latency_names[kind], (unsigned long long)latency[kind].count);
+    reply_printf(reply, "macros_played %llu\n", (unsigned long long)macros.started);
+    reply_printf(reply, "macros_ignored %llu\n", (unsigned long long)macros.dropped);
+    reply_printf(reply, "macro_steps %llu\n", (unsigned long long)macros.lateness.count);
+    reply_printf(reply, "commands_running %d\n", running);
+    reply_printf(reply, "commands_queued %d\n", queued);
+    reply_printf(reply, "log_dropped %lu\n", atomic_load_explicit(&logger.dropped, memory_order_relaxed));
+}
+
+void reply_status(reply_t* reply)
+{
+    uint64_t up = (clock_ns() - daemon_started) / 1000000000ULL;
+    int attached = 0;
+    reply_printf(reply, "Running as pid %d for %llud %02llu:%02llu:%02llu\n", getpid(),
+                 (unsigned long long)(up / 86400), (unsigned long long)(up / 3600 % 24),
+                 (unsigned long long)(up / 60 % 60), (unsigned long long)(up % 60));
+    reply_printf(reply, "Config %s: %d mappings, %d layers, layer %s active\n", config_path,
+                 config->mapping_count, config->layer_count, active_layer->name);
+    for (int i = 0; i < MAX_DEVICES; i++) {
+        if (devices[i].src.fd < 0) continue;
+        reply_printf(reply, "Device %s\n", devices[i].path);
+        attached++;
+    }
+    if (!attached) reply_printf(reply, "No input devices, waiting for %s%s\n", INPUT_DIR, config->device_patterns[0]);
+    if (lirc.dev.src.fd >= 0) reply_printf(reply, "Scancodes from %s\n", lirc.dev.path);
+    reply_printf(reply, "Virtual device %s\n", uinput_fd >= 0 ? "created" : "missing");
+    caps_t none;
+    memset(&none, 0, sizeof(none));
+    int missing = caps_missing(&none, &unannounced);
+    if (missing) reply_printf(reply, "%d codes from later devices or reloads are not announced, restart to send them\n", missing);
+    reply_printf(reply, "Log level %s", level_names[log_level]);
+    if (config->realtime_priority) reply_printf(reply, ", realtime priority %d", config->realtime_priority);
+    reply_printf(reply, "\n");
+}
+
+// Commands that change the daemon or show the config, which holds execute command lines
+int control_privileged(const char* command)
+{
+    return !strcmp(command, "reload") || !strcmp(command, "stop") || !strcmp(command, "mappings")
+        || !strcmp(command, "counters");
+}
+
+// uid is the sender's, anyone may ask for the status and stats, the rest needs root or the daemon's own user
+void run_control(const char* command, reply_t* reply, uid_t uid)
+{
+    if (control_privileged(command) && uid != 0 && uid != geteuid()) {
+        reply_printf(reply, "error: %s needs root or the user running the daemon\n", command);
+    } else if (!strcmp(command, "status")) {
+        reply_status(reply);
+    } else if (!strcmp(command, "reload")) {
+        uint64_t start = clock_ns();
+        int missing = reload_config();
+        if (missing < 0) reply_printf(reply, "error: reload failed, keeping the current mappings\n");
+        else reply_printf(reply, "Reloaded %s in %.2f ms\n", config_path, (clock_ns() - start) / 1e6);
+        if (missing > 0)
+            reply_printf(reply, "warning: the virtual device does not announce %d codes the new mappings send,"
+                         " they are dropped until numeric2mouse restart\n", missing);
+    } else if (!strcmp(command, "stop")) {
+        interrupted = SIGTERM;
+        reply_printf(reply, "Stopping\n");
+    } else if (!strcmp(command, "counters")) {
+        reply_counters(reply);
+    } else if (!strcmp(command, "stats")) {
+        format_stats(reply);
+    } else if (!strcmp(command, "mappings")) {
+        reply_mappings(reply);
+    } else {
+        reply_printf(reply, "error: unknown command '%s', try status, reload, stop, counters, stats or mappings\n", command);
+    }
+}
+
+void control_ready(event_source_t* src, uint32_t events)
+{
+    static reply_t reply;
+    char command[64];
+    char control_msg[CMSG_SPACE(sizeof(struct ucred))];
+    struct sockaddr_un from;
+
+    // Anyone can send commands, a flood must not keep the loop from input and
+    // timers: a few per wakeup, epoll reports the socket again for the rest
+    for (int handled = 0; handled < MAX_CONTROL_COMMANDS; handled++) {
+        // SO_PASSCRED makes the kernel attach who sent each datagram
+        struct iovec iov = {.iov_base = command, .iov_len = sizeof(command) - 1};
+        struct msghdr msg = {.msg_name = &from, .msg_namelen = sizeof(from), .msg_iov = &iov, .msg_iovlen = 1,
+                             .msg_control = control_msg, .msg_controllen = sizeof(control_msg)};
+        ssize_t n = recvmsg(src->fd, &msg, 0);
+        if (n < 0) break;
+        socklen_t from_len = msg.msg_namelen;
+        reply.len = 0;
+        if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+            // Never act on part of a command, or on one without the sender's credentials
+            log_debug("Control command cut short, refused");
+            reply_printf(&reply, "error: command too long\n");
+        } else {
+            uid_t uid = (uid_t)-1;
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS)
+                uid = ((struct ucred*)CMSG_DATA(cmsg))->uid;
+            while (n > 0 && (command[n - 1] == '\n' || command[n - 1] == ' ')) n--;
+            command[n] = 0;
+            log_debug("Control command %s", command);
+            run_control(command, &reply, uid);
+        }
+        // Never wait for a client, one that is not reading loses its answer
+        if (from_len > sizeof(sa_family_t) && sendto(src->fd, reply.data, reply.len, MSG_DONTWAIT,
+                                                     (struct sockaddr*)&from, from_len) < 0)
+            log_debug("Control reply lost: %s", strerror(errno));
+    }
+}
+
+int control_alive(void);
+
+void control_open(void)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (!strcmp(control_path, "none")) return;
+    if (strlen(control_path) >= sizeof(addr.sun_path)) {
+        log_warn("Control socket path %s too long", control_path);
+        return;
+    }
+    strcpy(addr.sun_path, control_path);
+
+    control.fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (control.fd < 0) die("error: socket");
+    int on = 1;
+    if (setsockopt(control.fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0) die("error: setsockopt");
+    // Only a socket left behind by a daemon that did not exit cleanly is replaced
+    if (control_alive()) {
+        log_error("Another daemon answers on %s, running without a control socket", control_path);
+        close(control.fd);
+        control.fd = -1;
+        return;
+    }
+    unlink(control_path);
+    // Anyone can ask for the status, run_control() checks who may change something
+    mode_t mask = umask(0111);
+    int bound = bind(control.fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+    if (bound < 0) {
+        log_warn("Cannot create control socket %s: %s", control_path, strerror(errno));
+        close(control.fd);
+        control.fd = -1;
+        return;
+    }
+    control.handle = control_ready;
+    epoll_add(&control);
+}
+
+void control_close(void)
+{
+    if (control.fd < 0) return;
+    close(control.fd);
+    unlink(control_path);
+}
+
+// Client side: send command to the running daemon and print its answer
+enum { CONTROL_OK, CONTROL_ERROR, CONTROL_NOT_RUNNING = 3 };     // LSB status exit codes
+
+int control_request(const char* command, int print)
+{
+    static char reply[CONTROL_REPLY_SIZE];
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    // Autobind to an abstract address so the daemon has somewhere to answer
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(sa_family_t)) < 0) die("error: socket");
+    struct timeval timeout = {.tv_sec = CONTROL_TIMEOUT_MS / 1000, .tv_usec = CONTROL_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    strncpy(addr.sun_path, control_path, sizeof(addr.sun_path) - 1);
+
+    if (sendto(fd, command, strlen(command), 0, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        int running = errno != ENOENT && errno != ECONNREFUSED;
+        if (running) fprintf(stderr, "Cannot reach %s: %s\n", control_path, strerror(errno));
+        close(fd);
+        return running ? CONTROL_ERROR : CONTROL_NOT_RUNNING;
+    }
+    ssize_t n = recv(fd, reply, sizeof(reply), 0);
+    close(fd);
+    if (n < 0) {
+        fprintf(stderr, "No answer from %s: %s\n", control_path, strerror(errno));
+        return CONTROL_ERROR;
+    }
+    if (print || !strncmp(reply, "error", 5)) fwrite(reply, 1, n, strncmp(reply, "error", 5) ? stdout : stderr);
+    return strncmp(reply, "error", 5) ? CONTROL_OK : CONTROL_ERROR;
+}
+
+// Whether a daemon still has the control socket open, without sending it anything
+int control_alive(void)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, control_path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    int alive = fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    if (fd >= 0) close(fd);
+    return alive;
+}
+
+/*
+ * Service commands, talking to the running daemon over its control socket:
+ * start, stop, restart, reload, status and the counters, stats and mappings
+ * inspection commands. "--control PATH" in front picks another socket.
+ */
+int handle_systemd(int argc, char* argv[])
+{
+    int skip = argc == 4 && !strcmp(argv[1], "--control") ? 2 : 0;
+    if (skip) control_path = argv[2];
+    if (argc - skip != 2) return argc;
+    const char* command = argv[argc - 1];
+
+    if (!strcmp(command, "stop") || !strcmp(command, "restart")) {
+        int result = control_request("stop", 0);
+        if (result == CONTROL_OK) {
+            // Wait for the old daemon to let go of the devices
+            for (int waited = 0; control_alive() && waited < 5000; waited += 10)
+                usleep(10000);
+        }
+        if (!strcmp(command, "stop")) exit(result == CONTROL_NOT_RUNNING ? 0 : result);
+        command = "start";
+    }
+    if (!strcmp(command, "start")) {
+        if (control_alive()) {
+            printf("Already running\n");
+            exit(0);
+        }
+        // The daemon itself, minus the command word
+        argv[argc - 1] = NULL;
+        return argc - 1;
+    }
+    if (!strcmp(command, "status") || !strcmp(command, "reload") || !strcmp(command, "counters")
+            || !strcmp(command, "stats") || !strcmp(command, "mappings")) {
+        int result = control_request(command, 1);
+        if (result == CONTROL_NOT_RUNNING) printf("Not running\n");
+        exit(result);
+    }
+    return argc;
+}
+
+void hotplug_ready(event_source_t* src, uint32_t events)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
+    ssize_t len = read(src->fd, buf, sizeof(buf));
+    if (len <= 0) return;
+
+    for (char* p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+        struct inotify_event* ie = (struct inotify_event*)p;
+        if (ie->mask & IN_IGNORED) {
+            // by-path goes away with the last device
+            if (ie->wd == hotplug.dir_wd) {
+                hotplug.dir_wd = -1;
+                watch_input_dir();
+            }
+            continue;
+        }
+        if (!ie->len) continue;
+        if (ie->wd == hotplug.config_wd) {
+            // Editors either rewrite the file or rename a new one over it
+            if (!strcmp(ie->name, config_name)) reload_config();
+            continue;
+        }
+        if (ie->wd == hotplug.root_wd) {
+            if (!strcmp(ie->name, "by-path")) watch_input_dir();
+            continue;
+        }
+        if (ie->wd != hotplug.dir_wd || !match_device(ie->name)) continue;
+
+        snprintf(path, sizeof(path), "%s%s", INPUT_DIR, ie->name);
+        if (ie->mask & (IN_CREATE | IN_MOVED_TO)) {
+            attach_device(path);
+        } else {
+            input_device_t* dev = find_device(path);
+            if (dev) detach_device(dev);
+        }
+    }
+}
+
+int compare_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Name of an event code for --print-flight
+const char* flight_code_name(int type, int code, char* buf, size_t size)
+{
+    static const char* syn[] = {"SYN_REPORT", "SYN_CONFIG", "SYN_MT_REPORT", "SYN_DROPPED"};
+    static const char* rel[] = {"REL_X", "REL_Y", "REL_Z", "REL_RX", "REL_RY", "REL_RZ", "REL_HWHEEL", "REL_DIAL", "REL_WHEEL"};
+    const char* name = NULL;
+    if (type == EV_KEY) name = key_code_name(code);
+    else if (type == EV_SYN && code < 4) name = syn[code];
+    else if (type == EV_REL && code < 9) name = rel[code];
+    else if (type == EV_ABS && code <= ABS_Y) name = code == ABS_X ? "ABS_X" : "ABS_Y";
+    else if (type == EV_MSC && code == MSC_SCAN) name = "MSC_SCAN";
+    if (name) return name;
+    // Keys made from scancodes are numbered by the config, the scancode is in the record before
+    if (type == EV_KEY && code >= KEY_CNT) snprintf(buf, size, "scancode key %d", code - KEY_CNT);
+    else snprintf(buf, size, type == EV_LIRC ? "protocol %d" : "0x%x", code);
+    return buf;
+}
+
+/*
+ * Print the flight recorder ring at path oldest first, or with export write
+ * the input events in the capture format of --record so they can be replayed.
+ * Keys made from scancodes are left out of an export, replaying the
+ * scancodes makes them again.
+ */
+int flight_decode(const char* path, int export)
+{
+    static const char* types[] = {"EV_SYN", "EV_KEY", "EV_REL", "EV_ABS", "EV_MSC"};
+    static const char* notes[] = {"forwarded", "held by a sequence", "dropped", "ignored", "swallowed"};
+    struct stat st;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    flight_header_t* header = (size_t)st.st_size >= sizeof(flight_header_t)
+        ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (header == MAP_FAILED || header->magic != FLIGHT_MAGIC || header->version != FLIGHT_VERSION
+            || header->record_size != sizeof(flight_record_t) || header->capacity & (header->capacity - 1)
+            || (size_t)st.st_size != sizeof(flight_header_t) + (size_t)header->capacity * sizeof(flight_record_t)) {
+        fprintf(stderr, "%s is not a flight recorder file of this version\n", path);
+        if (header != MAP_FAILED) munmap(header, st.st_size);
+        return -1;
+    }
+
+    const flight_record_t* records = (const flight_record_t*)(header + 1);
+    uint64_t head = header->head, first = head > header->capacity ? head - header->capacity : 0;
+    if (!export) printf("# %s: %llu records, the last %llu kept, oldest first\n", path,
+                        (unsigned long long)head, (unsigned long long)(head - first));
+    for (uint64_t i = first; i < head; i++) {
+        const flight_record_t* r = &records[i & (header->capacity - 1)];
+        char number[32], device[16];
+        unsigned long long sec = r->time / 1000000000ULL, usec = r->time % 1000000000ULL / 1000;
+
+        if (r->kind == FLIGHT_START) {
+            time_t started = header->created + (uint32_t)r->value;
+            char date[32];
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&started));
+            printf("# started %s\n", date);
+            continue;
+        }
+        if (export) {
+            if (r->kind != FLIGHT_IN || r->action == FLIGHT_DROPPED || (r->type == EV_KEY && r->device == FLIGHT_LIRC))
+                continue;
+            if (r->type == EV_LIRC) {
+                struct lirc_scancode sc = {.timestamp = r->time, .flags = r->flags, .rc_proto = r->code,
+                                           .scancode = (uint32_t)r->value};
+                write_scancode_line(stdout, &sc);
+            } else {
+                struct input_event ev = {.time = {.tv_sec = sec, .tv_usec = usec}, .type = r->type,
+                                         .code = r->code, .value = r->value};
+                write_capture_line(stdout, &ev);
+            }
+            continue;
+        }
+
+        if (r->device == FLIGHT_LIRC) snprintf(device, sizeof(device), "lirc");
+        else if (r->device == FLIGHT_POINTER) snprintf(device, sizeof(device), "pointer");
+        else if (r->device == FLIGHT_OTHER) snprintf(device, sizeof(device), "replay");
+        else if (r->kind == FLIGHT_OUT) snprintf(device, sizeof(device), "uinput");
+        else snprintf(device, sizeof(device), "dev %d", r->device);
+        printf("%llu.%06llu %-3s %-7s ", sec, usec, r->kind == FLIGHT_IN ? "in" : "out", device);
+        if (r->type == EV_LIRC) printf("%-6s %-20s 0x%x", "lirc", flight_code_name(r->type, r->code, number, sizeof(number)),
+                                       (uint32_t)r->value);
+        else printf("%-6s %-20s %d", r->type < 5 ? types[r->type] : "?", flight_code_name(r->type, r->code, number, sizeof(number)),
+                    r->value);
+        if (r->kind == FLIGHT_IN && r->action <= ACTION_MACRO) printf("  %s", action_names[r->action]);
+        else if (r->kind == FLIGHT_IN && r->action >= FLIGHT_FORWARDED && r->action <= FLIGHT_SWALLOWED)
+            printf("  %s", notes[r->action - FLIGHT_FORWARDED]);
+        printf("\n");
+    }
+    munmap(header, st.st_size);
+    return 0;
+}
+
+/*
+ * Feed a capture through handle_input_event() on the capture's own clock,
+ * timers fire at their deadlines in between, and report how long the daemon
+ * spent on each event. Lines are "seconds.microseconds type code value".
+ */
+int run_replay(const char* path, int loops)
+{
+    FILE* file = fopen(path, "re");
+    if (!file) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // Scancode records become EV_LIRC events, the protocol as code, the flags as value
+    // and the scancode itself at the same index in scancodes[]
+    int count = 0, capacity = 1024;
+    struct input_event* events = malloc(capacity * sizeof(*events));
+    uint64_t* scancodes = malloc(capacity * sizeof(*scancodes));
+    char line[256];
+    while (events && scancodes && fgets(line, sizeof(line), file)) {
+        unsigned long sec, usec;
+        unsigned int type, code;
+        unsigned long long scancode = 0;
+        int value;
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%lu.%lu lirc %u 0x%llx %d", &sec, &usec, &code, &scancode, &value) == 5) type = EV_LIRC;
+        else if (sscanf(line, "%lu.%lu %u %u %d", &sec, &usec, &type, &code, &value) != 5) continue;
+        if (count == capacity) {
+            capacity *= 2;
+            events = realloc(events, capacity * sizeof(*events));
+            scancodes = realloc(scancodes, capacity * sizeof(*scancodes));
+        }
+        if (!events || !scancodes) break;
+        scancodes[count] = scancode;
+        events[count].time.tv_sec = sec;
+        events[count].time.tv_usec = usec;
+        events[count].type = type;
+        events[count].code = code;
+        events[count].value = value;
+        count++;
+    }
+    fclose(file);
+    if (!events || !scancodes) die("error: malloc");
+    if (count == 0) {
+        fprintf(stderr, "No events in %s\n", path);
+        free(events);
+        free(scancodes);
+        return -1;
+    }
+
+    uint64_t first = events[0].time.tv_sec * 1000000000ULL + events[0].time.tv_usec * 1000ULL;
+    uint64_t last = events[count - 1].time.tv_sec * 1000000000ULL + events[count - 1].time.tv_usec * 1000ULL;
+    uint64_t span = last - first + 1000000000ULL;
+    uint32_t* latency = malloc((size_t)count * loops * sizeof(uint32_t));
+    if (!latency) die("error: malloc");
+
+    // Stands in for the input device, so held keys are tracked like they are live
+    static input_device_t replay_device = {.src.fd = -1, .clock = CLOCK_MONOTONIC, .path = "replay"};
+
+    replay_clock = 1000000000ULL;
+    uint64_t output_before = output_count;
+    uint64_t wall = clock_ns();
+    for (int loop = 0; loop < loops; loop++) {
+        uint64_t base = replay_clock - first + 1000000000ULL;
+        for (int i = 0; i < count; i++) {
+            struct input_event ev = events[i];
+            uint64_t t = base + ev.time.tv_sec * 1000000000ULL + ev.time.tv_usec * 1000ULL;
+            ev.time.tv_sec = t / 1000000000ULL;
+            ev.time.tv_usec = t % 1000000000ULL / 1000;
+            run_due_timers(t);
+
+            uint64_t start = clock_ns();
+            if (ev.type == EV_LIRC) {
+                struct lirc_scancode sc = {.timestamp = t, .flags = ev.value, .rc_proto = ev.code, .scancode = scancodes[i]};
+                lirc_feed(&sc);
+            } else {
+                handle_input_event(&replay_device, &ev);
+            }
+            latency[(size_t)loop * count + i] = clock_ns() - start;
+        }
+        run_due_timers(base + first + span);
+    }
+    flush_frame(uinput_fd);
+    wall = clock_ns() - wall;
+
+    size_t total = (size_t)count * loops;
+    qsort(latency, total, sizeof(uint32_t), compare_u32);
+    fprintf(stderr, "%s: %d events x %d loops, %llu output events, %.0f events/s, "
+            "latency p50 %.2f us p99 %.2f us max %.2f us\n",
+            path, count, loops, (unsigned long long)(output_count - output_before),
+            total / (wall / 1e9), latency[total / 2] / 1e3, latency[total * 99 / 100] / 1e3,
+            latency[total - 1] / 1e3);
+
+    free(latency);
+    free(events);
+    free(scancodes);
+    return 0;
+}
+
+atomic_int load_running;
+
+void* load_thread(void* arg)
+{
+    volatile uint64_t spins = 0;
+    while (atomic_load_explicit(&load_running, memory_order_relaxed))
+        spins++;
+    return NULL;
+}
+
+/*
+ * Hold a move_mouse key on the real motion timer while spinning threads keep
+ * every CPU busy, and report how evenly the output frames arrive, first as a
+ * normal thread and then in realtime mode. Run with --bench-jitter.
+ */
+void bench_jitter(void)
+{
+    const int seconds = 3;
+    const int priorities[] = {0, 50};
+    static config_t defaults;
+    pthread_t load[64];
+    int load_count = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    if (load_count < 2) load_count = 2;
+    if (load_count > 64) load_count = 64;
+
+    init_config(&defaults);
+    config = &defaults;
+    active_layer = &defaults.layers[0];
+    output_kind = OUTPUT_MEMORY;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) die("error: epoll_create1");
+    timer_init(&motion.timer, motion_tick);
+
+    uint64_t period = 1000000000ULL / defaults.motion_rate_hz;
+    int capacity = seconds * defaults.motion_rate_hz * 2;
+    uint32_t* deviation = malloc(capacity * sizeof(uint32_t));
+    if (!deviation) die("error: malloc");
+
+    atomic_store(&load_running, 1);
+    for (int i = 0; i < load_count; i++)
+        if (pthread_create(&load[i], NULL, load_thread, NULL)) die("error: pthread_create");
+
+    printf("%d busy threads, motion at %d Hz\n", load_count, defaults.motion_rate_hz);
+    printf("%9s %8s %10s %11s %10s %10s\n", "priority", "frames", "mean us", "stddev us", "p99 us", "max us");
+    for (unsigned int m = 0; m < sizeof(priorities) / sizeof(priorities[0]); m++) {
+        defaults.realtime_priority = priorities[m];
+        apply_realtime(&defaults);
+        if (priorities[m] && sched_getscheduler(0) != (SCHED_FIFO | SCHED_RESET_ON_FORK)
+                && sched_getscheduler(0) != SCHED_FIFO) {
+            printf("%9d skipped, needs CAP_SYS_NICE\n", priorities[m]);
+            continue;
+        }
+
+        int count = 0;
+        double sum = 0, sum_squares = 0;
+        uint64_t seen = output_count, last = 0;
+        uint64_t end = clock_ns() + seconds * 1000000000ULL;
+        motion_press(NULL, KEY_UP, 1, 0, &defaults.profiles[0]);
+        while (clock_ns() < end && count < capacity) {
+            struct epoll_event events[MAX_EPOLL_EVENTS];
+            int n = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, 100);
+            for (int i = 0; i < n; i++) {
+                event_source_t* src = events[i].data.ptr;
+                src->handle(src, events[i].events);
+            }
+            if (output_count == seen) continue;
+            seen = output_count;
+
+            // Gap between output frames against the motion period
+            uint64_t now = clock_ns();
+            if (last) {
+                double gap = (now - last) / 1e3;
+                sum += gap;
+                sum_squares += gap * gap;
+                deviation[count++] = now - last > period ? now - last - period : period - (now - last);
+            }
+            last = now;
+        }
+        motion_release(KEY_UP);
+        if (!count) continue;
+
+        double mean = sum / count;
+        qsort(deviation, count, sizeof(uint32_t), compare_u32);
+        printf("%9d %8d %10.1f %11.1f %10.1f %10.1f\n", priorities[m], count, mean,
+               sqrt(sum_squares / count - mean * mean),
+               deviation[(count * 99 + 99) / 100 - 1] / 1e3, deviation[count - 1] / 1e3);
+    }
+
+    atomic_store(&load_running, 0);
+    for (int i = 0; i < load_count; i++)
+        pthread_join(load[i], NULL);
+    defaults.realtime_priority = 0;
+    apply_realtime(&defaults);
+    free(deviation);
+}
+
+void usage(const char* name)
+{
+    printf("Usage: %s [options] [device...]\n"
+           "       %s [--control PATH] start|stop|restart|reload|status|counters|stats|mappings\n"
+           "\n"
+           "  -c, --config FILE      config file (default " CONFIG_PATH ")\n"
+           "      --cache FILE       compiled config cache (default " CACHE_PATH ")\n"
+           "      --no-cache         always parse the config file\n"
+           "      --check-config [FILE]\n"
+           "                         check the config file, or FILE, and exit\n"
+           "      --compile-config [FILE [CACHE]]\n"
+           "                         write the config cache, of FILE to CACHE, and exit\n"
+           "      --record FILE      save every input event and scancode to FILE for --replay\n"
+           "      --replay FILE      run a recorded capture instead of input devices\n"
+           "      --loops N          replay the capture N times (default 1)\n"
+           "      --output null|FILE where replayed output goes (default null)\n"
+           "      --bench-dispatch   time key code dispatch and exit\n"
+           "      --bench-flood      time reading a flood of pointer events and exit\n"
+           "      --bench-jitter     time pointer motion under CPU load and exit\n"
+           "      --bench-output     write to a virtual device that falls behind and exit\n"
+           "      --bench-macro      time overlapping macros and exit\n"
+           "  -d, --daemon           detach and run in the background\n"
+           "  -v, --verbose          log every key, same as --log-level debug\n"
+           "      --log-level LEVEL  error, warn, info or debug (default info)\n"
+           "      --control PATH     control socket, none to go without (default " CONTROL_PATH ")\n"
+           "      --flight-recorder FILE\n"
+           "                         ring of recent events, none to go without (default " FLIGHT_PATH ")\n"
+           "      --print-flight FILE\n"
+           "                         print a flight recorder ring and exit\n"
+           "      --export-flight FILE\n"
+           "                         write the input events of a ring as a capture for --replay and exit\n"
+           "  -h, --help             show this help\n"
+           "\n"
+           "A device under " INPUT_DIR " is grabbed, a " LIRC_PREFIX " device is read as raw scancodes.\n", name, name);
+}
+
+int main(int argc, char* argv[])
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    uint64_t started = daemon_started = clock_ns();
+
+    struct sigaction int_handler = {.sa_handler=handle_int};
+    sigaction(SIGINT, &int_handler, 0);
+    sigaction(SIGTERM, &int_handler, 0);
+
+    // SIGHUP reloads the config, SIGCHLD reaps commands, SIGUSR1 dumps latency and SIGUSR2 toggles debug logging,
+    // all handled in the event loop through a signalfd
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    argc = handle_systemd(argc, argv);
+
+    enum { OPT_CACHE = 256, OPT_NO_CACHE, OPT_CHECK, OPT_COMPILE, OPT_RECORD, OPT_REPLAY,
+           OPT_LOOPS, OPT_OUTPUT, OPT_BENCH_DISPATCH, OPT_BENCH_FLOOD, OPT_BENCH_JITTER, OPT_BENCH_OUTPUT, OPT_BENCH_MACRO, OPT_LOG_LEVEL, OPT_CONTROL,
+           OPT_FLIGHT, OPT_PRINT_FLIGHT, OPT_EXPORT_FLIGHT };
+    static const struct option options[] = {
+        {"config", required_argument, 0, 'c'},
+        {"cache", required_argument, 0, OPT_CACHE},
+        {"no-cache", no_argument, 0, OPT_NO_CACHE},
+        {"check-config", no_argument, 0, OPT_CHECK},
+        {"compile-config", no_argument, 0, OPT_COMPILE},
+        {"record", required_argument, 0, OPT_RECORD},
+        {"replay", required_argument, 0, OPT_REPLAY},
+        {"loops", required_argument, 0, OPT_LOOPS},
+        {"output", required_argument, 0, OPT_OUTPUT},
+        {"bench-dispatch", no_argument, 0, OPT_BENCH_DISPATCH},
+        {"bench-flood", no_argument, 0, OPT_BENCH_FLOOD},
+        {"bench-jitter", no_argument, 0, OPT_BENCH_JITTER},
+        {"bench-output", no_argument, 0, OPT_BENCH_OUTPUT},
+        {"bench-macro", no_argument, 0, OPT_BENCH_MACRO},
+        {"daemon", no_argument, 0, 'd'},
+        {"verbose", no_argument, 0, 'v'},
+        {"log-level", required_argument, 0, OPT_LOG_LEVEL},
+        {"control", required_argument, 0, OPT_CONTROL},
+        {"flight-recorder", required_argument, 0, OPT_FLIGHT},
+        {"print-flight", required_argument, 0, OPT_PRINT_FLIGHT},
+        {"export-flight", required_argument, 0, OPT_EXPORT_FLIGHT},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    const char* replay_path = NULL;
+    const char* output_spec = NULL;
+    const char* flight_spec = NULL;
+    int check = 0, compile = 0, daemonize = 0, loops = 1, opt;
+
+    while ((opt = getopt_long(argc, argv, "c:dvh", options, NULL)) != -1) {
+        switch (opt) {
+            case 'c': config_path = optarg; break;
+            case OPT_CACHE: cache_path = optarg; break;
+            case OPT_NO_CACHE: cache_path = NULL; break;
+            case OPT_CHECK: check = 1; break;
+            case OPT_COMPILE: compile = 1; break;
+            case OPT_RECORD:
+                record_file = fopen(optarg, "we");
+                if (!record_file) die("error: open record file");
+                break;
+            case OPT_REPLAY: replay_path = optarg; break;
+            case OPT_LOOPS: loops = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            case OPT_OUTPUT: output_spec = optarg; break;
+            case OPT_CONTROL: control_path = optarg; break;
+            case OPT_FLIGHT: flight_spec = optarg; break;
+            case OPT_PRINT_FLIGHT:
+                return flight_decode(optarg, 0) < 0 ? EXIT_FAILURE : 0;
+            case OPT_EXPORT_FLIGHT:
+                return flight_decode(optarg, 1) < 0 ? EXIT_FAILURE : 0;
+            case OPT_BENCH_DISPATCH:
+                bench_dispatch();
+                return 0;
+            case OPT_BENCH_FLOOD:
+                bench_flood();
+                return 0;
+            case OPT_BENCH_JITTER:
+                bench_jitter();
+                return 0;
+            case OPT_BENCH_OUTPUT:
+                bench_output();
+                return 0;
+            case OPT_BENCH_MACRO:
+                bench_macro();
+                return 0;
+            case 'd': daemonize = 1; break;
+            case 'v': log_level = base_log_level = LEVEL_DEBUG; break;
+            case OPT_LOG_LEVEL:
+                log_level = base_log_level = parse_log_level(optarg);
+                if (log_level < 0) {
+                    fprintf(stderr, "Unknown log level %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'h':
+                usage(basename(argv[0]));
+                return 0;
+            default:
+                usage(basename(argv[0]));
+                return EXIT_FAILURE;
+        }
+    }
+
+    // --check-config [file] and --compile-config [file] [cache] name their files after the
+    // option, the daemon takes devices, nothing else takes positional arguments
+    if (check || compile) {
+        if (optind < argc) config_path = argv[optind++];
+        if (compile && optind < argc) cache_path = argv[optind++];
+    }
+    if (optind < argc && (check || compile || replay_path)) {
+        fprintf(stderr, "Unexpected argument %s\n", argv[optind]);
+        usage(basename(argv[0]));
+        return EXIT_FAILURE;
+    }
+
+    if (check) {
+        static config_t checked;
+        return load_config(config_path, &checked) < 0 ? EXIT_FAILURE : 0;
+    }
+
+    if (compile) {
+        // Build the cache ahead of time, e.g. when installing a new config
+        static config_t compiled;
+        cache_header_t stamp;
+        if (!cache_path) cache_path = CACHE_PATH;
+        if (load_config(config_path, &compiled) < 0 || stamp_config(config_path, &stamp) < 0) return EXIT_FAILURE;
+        if (write_config_cache(cache_path, &stamp, &compiled) < 0) die("error: write config cache");
+        printf("Compiled %s to %s\n", config_path, cache_path);
+        return 0;
+    }
+
+    // Load configuration
+    config = open_config(config_path, cache_path);
+    if (!config) {
+        log_warn("Using defaults");
+        config = malloc(sizeof(config_t));
+        if (!config) die("error: malloc");
+        init_config(config);
+    }
+    active_layer = &config->layers[0];
+
+    if (replay_path) {
+        replaying = 1;
+        output_kind = OUTPUT_MEMORY;
+        if (output_spec && strcmp(output_spec, "null") != 0) {
+            output_kind = OUTPUT_FILE;
+            output_file = fopen(output_spec, "we");
+            if (!output_file) die("error: open output file");
+        }
+        timer_init(&motion.timer, motion_tick);
+        timer_init(&sequence.timer, sequence_tick);
+        timer_init(&combo_repeat.timer, combo_repeat_tick);
+        timer_init(&lirc.release, lirc_release_tick);
+        timer_init(&macros.timer, macro_tick);
+        log_start();
+        // Only on request, a replay should not overwrite the daemon's ring
+        if (flight_spec && strcmp(flight_spec, "none") != 0) flight_open(flight_spec);
+        int result = run_replay(replay_path, loops);
+        flight_close();
+        log_stop();
+        if (output_file) fclose(output_file);
+        return result < 0 ? EXIT_FAILURE : 0;
+    }
+    if (output_spec) {
+        fprintf(stderr, "--output only works with --replay\n");
+        return EXIT_FAILURE;
+    }
+
+    // A second daemon would take the control socket and the devices from the running one
+    if (strcmp(control_path, "none") && control_alive()) {
+        fprintf(stderr, "Already running, %s answers\n", control_path);
+        return EXIT_FAILURE;
+    }
+
+    if (daemonize && daemon(0, 0) < 0) die("error: daemon");
+
+    // After daemon(), the fork would leave the thread behind
+    log_start();
+    if (!flight_spec || strcmp(flight_spec, "none") != 0) flight_open(flight_spec ? flight_spec : FLIGHT_PATH);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) die("error: epoll_create1");
+
+    for (int i = 0; i < MAX_DEVICES; i++)
+        devices[i].src.fd = -1;
+
+    // Devices named on the command line, matching devices are picked up below
+    for (int i = optind; i < argc; i++) {
+        if (!strncmp(argv[i], LIRC_PREFIX, strlen(LIRC_PREFIX))) {
+            if (lirc_open(argv[i]) < 0) die("error: open lirc device");
+            lirc_cli = 1;
+            continue;
+        }
+        if (attach_device(argv[i]) < 0) die("error: open input_device");
+        if (!strncmp(argv[i], INPUT_DIR, strlen(INPUT_DIR)) && cli_pattern_count < MAX_DEVICE_PATTERNS)
+            strncpy(cli_patterns[cli_pattern_count++], argv[i] + strlen(INPUT_DIR), NAME_MAX);
+    }
+
+    hotplug.src.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (hotplug.src.fd < 0) die("error: inotify_init1");
+    hotplug.src.handle = hotplug_ready;
+    hotplug.dir_wd = hotplug.root_wd = -1;
+    epoll_add(&hotplug.src);
+    watch_input_dir();
+
+    char config_dir[PATH_MAX];
+    strncpy(config_dir, config_path, sizeof(config_dir) - 1);
+    config_name = strrchr(config_path, '/') ? strrchr(config_path, '/') + 1 : config_path;
+    dirname(config_dir);
+    hotplug.config_wd = inotify_add_watch(hotplug.src.fd, config_dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (hotplug.config_wd < 0) log_warn("Cannot watch %s, reload with SIGHUP", config_dir);
+
+    signals.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signals.fd < 0) die("error: signalfd");
+    signals.handle = signal_ready;
+    epoll_add(&signals);
+    control_open();
+
+    // Announce what the grabbed devices and the mappings can send, the device
+    // never changes after this, see uinput_check()
+    caps_t caps;
+    memset(&caps, 0, sizeof(caps));
+    config_caps(config, &caps);
+    for (int i = 0; i < MAX_DEVICES; i++)
+        if (devices[i].src.fd >= 0) device_caps(devices[i].src.fd, &caps);
+    create_uinput(&caps);
+    if (config_has_grid(config)) create_pointer();
+
+    // Let inputlirc pick up the new device, without waiting for it
+    if (config->reload_inputlirc && access(INPUTLIRC_INIT, X_OK) == 0) {
+        char* reload[] = {INPUTLIRC_INIT, "reload", NULL};
+        spawn_command(reload, INPUTLIRC_INIT " reload", NULL);
+    }
+
+    int attached = 0;
+    for (int i = 0; i < MAX_DEVICES; i++)
+        if (devices[i].src.fd >= 0) attached++;
+    if (!attached) log_info("Waiting for input devices matching %s%s", INPUT_DIR, config->device_patterns[0]);
+
+    timer_init(&motion.timer, motion_tick);
+    timer_init(&sequence.timer, sequence_tick);
+    timer_init(&combo_repeat.timer, combo_repeat_tick);
+    timer_init(&lirc.release, lirc_release_tick);
+    timer_init(&macros.timer, macro_tick);
+    if (!lirc_cli && config->lirc_device[0]) lirc_open(config->lirc_device);
+    log_info("Motion engine running at %d Hz", config->motion_rate_hz);
+
+    timer_init(&stats_timer, stats_tick);
+    if (config->stats_interval)
+        timer_arm(&stats_timer, config->stats_interval * 1000000000ULL, config->stats_interval * 1000000000ULL);
+
+    if (config->realtime_priority || config->cpu_affinity) apply_realtime(config);
+
+    log_info("Started in %.1f ms", (clock_ns() - started) / 1e6);
+
+    while(!interrupted)
+    {
+        int n = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die("error: epoll_wait");
+        }
+        for (int i = 0; i < n; i++) {
+            event_source_t* src = events[i].data.ptr;
+            src->handle(src, events[i].events);
+        }
+    }
+
+    log_info("Stopping on signal %d", interrupted);
+    control_close();
+    destroy_uinput();
+    if (pointer_fd >= 0) {
+        output_flush(pointer_fd);
+        ioctl(pointer_fd, UI_DEV_DESTROY);
+        close(pointer_fd);
+    }
 
-    close(fdi);
-    close(fdo);
+    for (int i = 0; i < MAX_DEVICES; i++)
+        if (devices[i].src.fd >= 0) close(devices[i].src.fd);
+    if (lirc.dev.src.fd >= 0) close(lirc.dev.src.fd);
+    close(hotplug.src.fd);
+    close(signals.fd);
+    for (int i = 0; i < timer_count; i++)
+        close(timers[i]->src.fd);
+    close(epfd);
+    flight_close();
+    if (record_file) fclose(record_file);
+    log_stop();
 
     return 0;
 }